@@ -23,6 +23,16 @@ void lcdsend(unsigned char segment) {
   SSPBUF = segment;
 }
 
+// FOSC/4 (1MHz) or FOSC/16 (250kHz). lcd_init() starts out slow.
+void lcd_spi_fast(unsigned char fast) {
+  while (!BF);  // don't change the clock in the middle of a byte
+  // The MSSP has to be off (SSPEN clear) while it's reconfigured. That
+  // resets it, so it needs another dummy byte, like lcd_init() sends.
+  SSPCON = fast ? 0b00000000 : 0b00000001;
+  SSPCON = fast ? 0b00100000 : 0b00100001;
+  SSPBUF = 0;
+}
+
 void lcdstartcmd(void) {
   while (LCD_BUSY);
   LCD_CS = 0;
@@ -51,11 +61,32 @@ void lcd_sleep(void) {
   lcdendcmd();
 }
 
-void lcd_disp_fullscrn(void) {
+// Shows the screen's worth of display RAM that starts at start.
+void lcd_disp_fullscrn(unsigned start) {
   // Display Fullscreen
   lcdstartcmd();
   lcdsend(0x18); // DISP_FULLSCRN
+  lcdsend(start >> 8);
+  lcdsend(start);
+  lcdendcmd();
+}
+
+// Refreshes only the box from (x0, y0) to (x1, y1), corners included, and
+// leaves the rest of the panel alone. x0 and x1 + 1 should be multiples of
+// 8. Much quicker than a full screen refresh, but it leaves a little
+// ghosting behind, so the server does a full one every so often.
+void lcd_disp_area(unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+  lcdstartcmd();
+  lcdsend(0x19); // DISP_AREA
   lcdsend(0);
   lcdsend(0);
+  lcdsend(x0 >> 8);
+  lcdsend(x0);
+  lcdsend(y0 >> 8);
+  lcdsend(y0);
+  lcdsend(x1 >> 8);
+  lcdsend(x1);
+  lcdsend(y1 >> 8);
+  lcdsend(y1);
   lcdendcmd();
 }
@@ -29,7 +29,10 @@ extern void clr_disp_drk(void);
 extern void lcdstartcmd(void);
 extern void lcdendcmd(void);
 extern void lcdsend(unsigned char);
-extern void lcd_disp_fullscrn(void);
+extern void lcd_spi_fast(unsigned char fast);
+extern void lcd_disp_fullscrn(unsigned start);
+extern void lcd_disp_area(unsigned x0, unsigned y0, unsigned x1,
+                          unsigned y1);
 extern void lcd_sleep(void);
 
 #endif  // HARDWARE_SIGNAGE_DISPLAY_LCD_H__
@@ -23,7 +23,7 @@ limitations under the License.
 #include "pause.h"
 #include "revision.h"
 
-// $Revision: #23 $
+// $Revision: #28 $
 
 __CONFIG(INTIO & WDTDIS & MCLREN & BORDIS & UNPROTECT & PWRTEN);
 
@@ -35,10 +35,26 @@ unsigned char cap_voltage;
 unsigned char temperature;
 unsigned char button_status;
 unsigned char seq_num;
+// The page schedule from the last transfer (see OPT_PAGES in main.h). The
+// pages are shown while we sleep, without the radio, so a transfer can leave
+// a whole day's worth of screens behind. page_count is 0 while the display
+// RAM is being written, since the old pages can't be trusted until the
+// transfer is done.
+unsigned char page_count;
+unsigned char page;
+unsigned page_address;
+unsigned flip_interval;
+// In units of 2^5 ticks, like a sleep with exponent 0. flip_step is what
+// each sleep adds.
+unsigned long flip_elapsed;
+unsigned long flip_step;
 #ifdef DEBUG
 bit updating;
 #endif
 
+// 92 ~= 1.09V. Below that, we can't reliably send a radio message.
+#define MIN_RADIO_VOLTAGE 92
+
 // Check voltage on some pin
 // pin is specified as bits 5-2 in ADCON0. See the datasheet.
 // left vs. right justified is specified as bit 7.
@@ -112,6 +128,7 @@ void send_hello(void) {
 
   putc(seq_num - 1);  // Last packet received
   putc(temperature);
+  putc(CAPABILITIES);
 }
 
 void send_ack(void) {
@@ -125,6 +142,7 @@ void send_nak(unsigned char failure_mode) {
   putc(NAK);
   putc(seq_num - 1);  // Last packet received
   putc(failure_mode);
+  putc(rx_overruns);
   radio_sleep();
 }
 
@@ -134,10 +152,21 @@ void send_nak(unsigned char failure_mode) {
 //
 // Protocol format:
 // cancel =        {CAN sleep_bytes}
+// options =       {SOH sequence_byte length options...}
 // normal packet = {STX sequence_byte command_length data...}
-// last packet =   {ETX sequence_byte command_length data... sleep_bytes}
+// last packet =   {ETX sequence_byte command_length data... sleep_bytes
+//                  [page_schedule]}
 // command_length is the number of bytes in the data that follows. This is the
 // same as the number of bytes to hold /CS low for.
+// If command_length has RLE_FLAG set, the low seven bits are instead the
+// number of PackBits encoded bytes that follow. Each run starts with a control
+// byte n: 0-127 means copy the next n+1 bytes, 129-255 means repeat the next
+// byte 257-n times, and 128 is skipped. The server keeps repeats short enough
+// that the receive buffer doesn't fill up while they're expanded.
+// An options packet can come first, to turn on things the hello said we
+// support (see CAP_* in main.h) for the rest of this wakeup. It's numbered
+// like any other packet. Options we don't know about are ignored. With
+// OPT_PAGES, the last packet ends with the page schedule.
 // sequence_byte is a normal sequence number. (This means there can only be
 // 256 packets, but a full screen update only takes 104.) The sequence number
 // increases by one for each packet, starting at 0. If a packet is recieved
@@ -149,9 +178,14 @@ bit do_radio_stuff(void) {
   unsigned char header;
   unsigned char command_len;
   unsigned char seq_num_got;
-  // The compiler forces this to be static, but it doesn't change how the bit
-  // is used.
+  unsigned char run;
+  unsigned char data;
+  unsigned char pages;
+  unsigned interval;
+  // The compiler forces these to be static, but it doesn't change how the
+  // bits are used.
   static bit ok_to_write;
+  static bit with_pages;
 
 #ifdef DEBUG
   // Clear the LCD memory. This takes place internal to the display's RAM, so
@@ -167,6 +201,10 @@ bit do_radio_stuff(void) {
   lcdendcmd();
 #endif
 
+  // Options from the last wakeup don't carry over.
+  lcd_spi_fast(0);
+  with_pages = 0;
+
   radio_wake();
   send_hello();
   LED = 1;
@@ -193,6 +231,9 @@ bit do_radio_stuff(void) {
   while (!RCIF)
     len++;
 
+  // From here on the interrupt handler takes bytes as they come in, including
+  // the one we just saw, so the UART keeps going while we talk to the display.
+  rx_start();
   CLRWDT();
   putc(TIMING_REPORT);
   putc(len >> 8);
@@ -213,19 +254,18 @@ bit do_radio_stuff(void) {
       return 1; // go back to sleep
     }
 
-    if (header != STX && header != ETX) {
-      // Garbage start - fail
-      send_nak(FAIL_NO_HEADER);
+    // Recieve overflow - the server sent more than the receive buffer holds
+    // while we were busy with the display. Bytes are missing from the last
+    // packet, and what we just read as a header may be the middle of one, so
+    // this has to be checked first.
+    if (rx_overruns) {
+      send_nak(FAIL_OVERRUN);
       return 0;
     }
 
-    // Recieve overflow - generally happens if the display takes too long to
-    // do something. An overflow is especially insidious because the PIC has a
-    // two byte FIFO buffer, and doesn't recieve anything while those are
-    // full. This means that the first two bytes (STX and the sequence number)
-    // will be stored, and it will look like a valid packet to the radish!
-    if (OERR) {
-      send_nak(FAIL_OVERRUN);
+    if (header != STX && header != ETX && header != SOH) {
+      // Garbage start - fail
+      send_nak(FAIL_NO_HEADER);
       return 0;
     }
 
@@ -242,9 +282,47 @@ bit do_radio_stuff(void) {
 
     command_len = getc();
 
+    if (header == SOH) {
+      // Only the first byte means anything yet.
+      if (command_len) {
+        data = getc();
+        command_len--;
+        if (ok_to_write) {
+          lcd_spi_fast(data & OPT_SPI_FAST);
+          with_pages = (data & OPT_PAGES) != 0;
+        }
+      }
+      for (; command_len; command_len--)
+        getc();
+      continue;
+    }
+
     // now in data mode
-    if (ok_to_write)
+    if (ok_to_write) {
+      page_count = 0;
       lcdstartcmd();
+    }
+    if (command_len & RLE_FLAG) {
+      command_len &= ~RLE_FLAG;
+      while (command_len) {
+        LED = !(command_len & 3);
+        run = getc();
+        command_len--;
+        if (!(run & 0x80)) {  // Literal: copy run + 1 bytes
+          for (run++; run && command_len; run--, command_len--) {
+            data = getc();
+            if (ok_to_write)
+              lcdsend(data);
+          }
+        } else if (run != 0x80 && command_len) {  // Repeat 257 - run times
+          data = getc();
+          command_len--;
+          if (ok_to_write)
+            for (run = 1 - run; run; run--)
+              lcdsend(data);
+        }
+      }
+    }
     for (; command_len; command_len--) {
       // LED will be on 1/4 of the time. Simpler code.
       LED = !(command_len & 3);
@@ -260,9 +338,29 @@ bit do_radio_stuff(void) {
     if (header == ETX) {
       sleep_count = getc();
       exponent = getc();
+      pages = 1;
+      interval = 0;
+      if (with_pages) {
+        pages = getc();
+        interval = getc() << 8;
+        interval |= getc();
+      }
+      // The last packet needs the overrun check too, since nothing comes
+      // after it.
+      if (rx_overruns) {
+        send_nak(FAIL_OVERRUN);
+        return 0;
+      }
       // We have to retry if we're ignoring this packet.
-      if (ok_to_write)
+      if (ok_to_write) {
+        // The last packet shows the first page.
+        page_count = pages;
+        flip_interval = interval;
+        page = 0;
+        page_address = 0;
+        flip_elapsed = 0;
         break;
+      }
     }
   }
 
@@ -274,6 +372,29 @@ bit do_radio_stuff(void) {
   return 1;
 }
 
+// Shows the next page of the schedule, if there is one. Called from the
+// sleep loop, so the watchdog is running.
+void show_next_page(void) {
+  // A refresh takes a good bite out of the capacitor. If we're already too
+  // low for the radio, the page will have to wait.
+  if (read_analog(0b00001000) < MIN_RADIO_VOLTAGE)  // AN2 = RA2, left justified
+    return;
+  if (page + 1 < (page_count & ~PAGES_ROTATE)) {
+    page++;
+    page_address += PAGE_SIZE;
+  } else if (page_count & PAGES_ROTATE) {
+    page = 0;
+    page_address = 0;
+  } else {
+    return;  // Stay on the last page
+  }
+  SWDTEN = 0;  // The refresh can take longer than a sleep.
+  lcd_disp_fullscrn(page_address);
+  lcd_sleep();  // Blocks while the screen updates.
+  CLRWDT();
+  SWDTEN = 1;
+}
+
 void setup_sleeptime(void) {
 
 // The format is two bytes. First byte is a loop count of how many times to
@@ -285,9 +406,10 @@ void setup_sleeptime(void) {
 // across two separate postscalers. The TMR0 postscaler can go up to 7,
 // (1:128), while the WDT postscaler goes up to 11. I choose between not using
 // the TMR0 scaler, or using it to the max.
+  if (exponent > 18)
+    exponent = 18;
+  flip_step = 1UL << exponent;
   if (exponent > 7) {
-    if (exponent > 18)
-      exponent = 18;
     exponent -= 7;
     // Disable pull-ups, 128:1 WDT prescaler
     OPTION = 0x8F;
@@ -318,6 +440,8 @@ void main(void) {
     button_status = 1 << 5;
   }
   POR = 1;  // Hardware doesn't set this on reset
+  // Whatever the display RAM holds, we've lost track of it.
+  page_count = 0;
 
   init_all();
 
@@ -331,7 +455,7 @@ void main(void) {
   // This makes it good for testing retry and partial update algorithms.
 
   if (updating) {  // Draw however much we managed to get
-    lcd_disp_fullscrn();
+    lcd_disp_fullscrn(0);
   }
   updating = 0;
 #endif
@@ -389,13 +513,13 @@ soft_reset:  // Jump here to simulate a reset, i.e. a bad transmission
       temperature ^= 128;
     }
 
-    // 92 ~= 1.09V. Below that, we can't reliably send a radio message. Since
+    // Below MIN_RADIO_VOLTAGE we can't reliably send a radio message. Since
     // using the radio eats power, and failing to send a message eats even
     // more, just go back to sleep if we're really low.
     // This is needed to prevent the over-the-hump problem where we turn on at
     // .95V but never charge all the way to 1.1V where radio sends become
     // reliable.
-    if (cap_voltage >= 92) {
+    if (cap_voltage >= MIN_RADIO_VOLTAGE) {
       if (!do_radio_stuff())
         // Yes, gotos are evil, but sometimes they are the only way...
         goto soft_reset;
@@ -433,6 +557,24 @@ soft_reset:  // Jump here to simulate a reset, i.e. a bad transmission
       // We don't reset RABIF in this loop, so we'll burn through these sleeps
       // if there's a change. And that's exactly what we want.
       SLEEP();
+      // Unless there are pages to flip through. Then the app button shows
+      // the next one instead of waking the radio.
+      if ((page_count & ~PAGES_ROTATE) > 1) {
+        if (TO) {  // Woken by a change, not the WDT
+          PORTA;
+          RABIF = 0;
+          sleep_count++;  // The sleep starts over
+          if (RA4)  // Pressed, not released
+            show_next_page();
+        } else {
+          flip_elapsed += flip_step;
+          if (flip_interval &&
+              flip_elapsed >= (unsigned long)flip_interval << 8) {
+            flip_elapsed = 0;
+            show_next_page();
+          }
+        }
+      }
       TO = 1;  // Reset this bit after all sleeps
     }
     SWDTEN = 0;
@@ -18,6 +18,7 @@ limitations under the License.
 #define HARDWARE_SIGNAGE_DISPLAY_MAIN_H__
 
 #define NUL 0x00  // padding to flush xbee output buffer
+#define SOH 0x01  // server session options
 #define STX 0x02  // server start transfer
 #define ETX 0x03  // server end transfer
 #define EOT 0x04  // End of Transter (currently not used)
@@ -27,9 +28,38 @@ limitations under the License.
 #define CAN 0x18  // stop all communications and retry later
 #define TIMING_REPORT 0x0  // Report timing information
 
-// Failed due to not seeing CAN, STX, or ETX as the header byte
+// Set in a packet's command_length when the command bytes are run-length
+// encoded. The low seven bits are then the number of encoded bytes.
+#define RLE_FLAG 0x80
+
+// Capabilities, sent at the end of the hello so the server knows what it can
+// ask for. Older radishes don't send this byte at all.
+#define CAP_RLE 0x01        // decodes RLE_FLAG packets
+#define CAP_RX_BUFFER 0x02  // buffers the UART, so RLE repeats can be long
+#define CAP_SPI_FAST 0x04   // takes OPT_SPI_FAST
+#define CAP_PARTIAL_REFRESH 0x08  // display takes DISP_AREA
+#define CAP_PAGES 0x10      // takes OPT_PAGES and flips pages while asleep
+#define CAPABILITIES (CAP_RLE | CAP_RX_BUFFER | CAP_SPI_FAST | \
+                      CAP_PARTIAL_REFRESH | CAP_PAGES)
+
+// Bits in the first byte of an SOH packet. They only last until the radish
+// goes back to sleep.
+#define OPT_SPI_FAST 0x01  // clock the display at FOSC/4 instead of FOSC/16
+#define OPT_PAGES 0x02     // the ETX has a page schedule after the sleep bytes
+
+// The display RAM holds up to MAX_PAGES full screens, back to back from
+// address 0. The page schedule is a page count, with PAGES_ROTATE set to go
+// back to the first page after the last one, then two bytes of how long to
+// show each page for, in units of 2^13 ticks of the 31kHz clock (about a
+// quarter of a second). 0 means only the app button flips pages.
+#define PAGE_SIZE (320*240/8)
+#define MAX_PAGES 6
+#define PAGES_ROTATE 0x80
+
+// Failed due to not seeing CAN, SOH, STX, or ETX as the header byte
 #define FAIL_NO_HEADER 0
-// Failed due to buffer overrun in UART reception
+// Failed due to buffer overrun in UART reception. The NAK's last byte says
+// how many times it happened.
 #define FAIL_OVERRUN 1
 
 
@@ -0,0 +1,61 @@
+/*
+Copyright 2009 Google Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Simulator internals shared between the PIC core (sim.cc) and the XBee
+// emulation (radio.cc). The firmware never sees this.
+
+#ifndef HARDWARE_SIGNAGE_DISPLAY_SIM_CORE_H__
+#define HARDWARE_SIGNAGE_DISPLAY_SIM_CORE_H__
+
+#include <stdint.h>
+
+// One instruction cycle is 1uS with the 4MHz internal oscillator.
+#define CYCLES_PER_SEC 1000000
+
+// Cycles since the simulator started, including time spent asleep.
+extern uint64_t sim_cycles;
+extern int sim_verbose;
+
+// Prints a message prefixed with the simulated time in milliseconds.
+void sim_log(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+// A byte finished arriving on the PIC's RX pin.
+void uart_receive(unsigned char c);
+
+// Whether the firmware is holding the XBee's sleep pin high.
+bool radio_sleeping(void);
+
+// radio.cc
+struct RadioOptions {
+  const char *link;      // Symlink to create for the pty, or NULL
+  const char *address;   // 64-bit address of the radish's XBee, in hex
+  int rssi;              // -dBm reported in RECEIVE_PACKET frames
+  int loss_percent;      // Chance that a transmission to the radish is lost
+  unsigned seed;
+  bool escaped;          // API mode 2, with control characters escaped
+};
+
+void radio_open(const RadioOptions &options);
+// Reads anything the server wrote to the pty.
+void radio_poll(void);
+// Delivers scheduled bytes and status frames that are due.
+void radio_tick(void);
+// A byte finished shifting out of the PIC's TX pin.
+void radio_transmit(unsigned char c);
+void radio_print_stats(void);
+
+#endif  // HARDWARE_SIGNAGE_DISPLAY_SIM_CORE_H__
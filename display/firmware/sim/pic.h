@@ -0,0 +1,138 @@
+/*
+Copyright 2009 Google Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Stand-in for the HI-TECH <pic.h> when building the firmware natively for
+// the simulator. The firmware is compiled as C++ so that registers and
+// register bits can be objects that call into the simulator whenever they're
+// read or written. Only what the radish firmware actually uses is here.
+
+#ifndef HARDWARE_SIGNAGE_DISPLAY_SIM_PIC_H__
+#define HARDWARE_SIGNAGE_DISPLAY_SIM_PIC_H__
+
+#include "sim.h"
+
+typedef bool bit;
+
+#define main radish_main
+
+// The simulator calls isr() itself; see sim.h.
+#define interrupt
+
+#define __CONFIG(x) extern int sim_config_unused
+#define __IDLOC(x) extern int sim_idloc_unused
+
+#define NOP() sim_nop()
+#define CLRWDT() sim_clrwdt()
+#define SLEEP() sim_sleep()
+// The only inline assembly is the nop in pause_msec(), whose loop takes four
+// cycles per iteration.
+#define asm(x) sim_delay_loop()
+
+template <unsigned A> struct Sfr {
+  operator unsigned char() const { return sim_read(A); }
+  Sfr &operator=(unsigned char v) { sim_write(A, v); return *this; }
+  Sfr &operator|=(unsigned char v) {
+    sim_write(A, sim_read(A) | v);
+    return *this;
+  }
+  Sfr &operator&=(unsigned char v) {
+    sim_write(A, sim_read(A) & v);
+    return *this;
+  }
+  Sfr &operator^=(unsigned char v) {
+    sim_write(A, sim_read(A) ^ v);
+    return *this;
+  }
+};
+
+// Like the bsf/bcf instructions, setting a bit is a read-modify-write of the
+// whole register.
+template <unsigned A, unsigned B> struct SfrBit {
+  operator unsigned char() const { return (sim_read(A) >> B) & 1; }
+  SfrBit &operator=(unsigned v) {
+    unsigned char r = sim_read(A);
+    sim_write(A, v ? (r | (1 << B)) : (r & ~(1 << B)));
+    return *this;
+  }
+};
+
+inline Sfr<SFR_PORTA> PORTA;
+inline Sfr<SFR_PORTB> PORTB;
+inline Sfr<SFR_PORTC> PORTC;
+inline Sfr<SFR_TRISA> TRISA;
+inline Sfr<SFR_TRISB> TRISB;
+inline Sfr<SFR_TRISC> TRISC;
+inline Sfr<SFR_INTCON> INTCON;
+inline Sfr<SFR_PIR1> PIR1;
+inline Sfr<SFR_PIE1> PIE1;
+inline Sfr<SFR_SSPBUF> SSPBUF;
+inline Sfr<SFR_SSPCON> SSPCON;
+inline Sfr<SFR_TXREG> TXREG;
+inline Sfr<SFR_RCREG> RCREG;
+inline Sfr<SFR_ADRESH> ADRESH;
+inline Sfr<SFR_ADRESL> ADRESL;
+inline Sfr<SFR_ADCON0> ADCON0;
+inline Sfr<SFR_ADCON1> ADCON1;
+inline Sfr<SFR_OPTION> OPTION;
+inline Sfr<SFR_WDTCON> WDTCON;
+inline Sfr<SFR_SPBRG> SPBRG;
+inline Sfr<SFR_SPBRGH> SPBRGH;
+inline Sfr<SFR_ANSEL> ANSEL;
+inline Sfr<SFR_ANSELH> ANSELH;
+
+inline SfrBit<SFR_STATUS, 4> TO;
+inline SfrBit<SFR_STATUS, 3> PD;
+inline SfrBit<SFR_PCON, 1> POR;
+
+inline SfrBit<SFR_PORTA, 4> RA4;
+inline SfrBit<SFR_PORTA, 5> RA5;
+inline SfrBit<SFR_PORTC, 0> RC0;
+inline SfrBit<SFR_PORTC, 1> RC1;
+inline SfrBit<SFR_PORTC, 2> RC2;
+inline SfrBit<SFR_PORTC, 3> RC3;
+inline SfrBit<SFR_PORTC, 4> RC4;
+inline SfrBit<SFR_PORTC, 5> RC5;
+inline SfrBit<SFR_PORTC, 6> RC6;
+inline SfrBit<SFR_TRISB, 7> TRISB7;
+inline SfrBit<SFR_TRISC, 6> TRISC6;
+inline SfrBit<SFR_ANSELH, 0> ANS8;
+
+inline SfrBit<SFR_INTCON, 7> GIE;
+inline SfrBit<SFR_INTCON, 6> PEIE;
+inline SfrBit<SFR_INTCON, 3> RABIE;
+inline SfrBit<SFR_INTCON, 0> RABIF;
+inline SfrBit<SFR_IOCA, 4> IOCA4;
+
+inline SfrBit<SFR_PIR1, 5> RCIF;
+inline SfrBit<SFR_PIR1, 4> TXIF;
+inline SfrBit<SFR_PIE1, 5> RCIE;
+
+inline SfrBit<SFR_RCSTA, 7> SPEN;
+inline SfrBit<SFR_RCSTA, 4> CREN;
+inline SfrBit<SFR_RCSTA, 1> OERR;
+inline SfrBit<SFR_TXSTA, 5> TXEN;
+inline SfrBit<SFR_TXSTA, 4> SYNC;
+inline SfrBit<SFR_TXSTA, 2> BRGH;
+inline SfrBit<SFR_TXSTA, 1> TRMT;
+inline SfrBit<SFR_BAUDCTL, 3> BRG16;
+
+inline SfrBit<SFR_SSPSTAT, 0> BF;
+
+inline SfrBit<SFR_ADCON0, 1> GODONE;
+
+inline SfrBit<SFR_WDTCON, 0> SWDTEN;
+
+#endif  // HARDWARE_SIGNAGE_DISPLAY_SIM_PIC_H__
@@ -0,0 +1,319 @@
+/*
+Copyright 2009 Google Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Emulates the pair of XBees between the radish and the wongle. The
+// radish's XBee is in transparent mode and talks to the PIC's UART. The
+// wongle's XBee is in API mode (AP=1, or AP=2 with -e) and talks to the radio
+// server over a pseudo-terminal, exactly as the real one does over USB
+// serial.
+
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <deque>
+#include <vector>
+
+#include "core.h"
+
+#define START_BYTE 0x7E
+#define ESCAPE 0x7D
+#define TRANSMIT_REQUEST 0x00
+#define AT_COMMAND 0x08
+#define RECEIVE_PACKET 0x80
+#define AT_RESPONSE 0x88
+#define TRANSMIT_STATUS 0x89
+
+// The XBees talk to their hosts at 57600 baud, and to each other at
+// 250kbps.
+#define SERIAL_CHAR_CYCLES (CYCLES_PER_SEC * 10 / 57600)
+#define AIR_BYTE_CYCLES (CYCLES_PER_SEC * 8 / 250000)
+// MAC header, FCS and PHY preamble on every frame
+#define AIR_OVERHEAD_BYTES 21
+// Time for the 802.15.4 ACK to come back
+#define AIR_ACK_CYCLES 600
+// Transmissions are retried this many times before giving up
+#define AIR_RETRIES 3
+// Transparent mode sends what it has after this many character times of
+// silence (RO), or as soon as it has a full packet.
+#define PACKETIZATION_CHARS 3
+#define MAX_PAYLOAD 100
+
+struct ScheduledByte {
+  uint64_t at;
+  unsigned char c;
+};
+
+struct ScheduledStatus {
+  uint64_t at;
+  unsigned char frame_id;
+  unsigned char status;
+};
+
+static int pty = -1;
+static unsigned char address[8];
+static RadioOptions options;
+
+static std::vector<unsigned char> from_server;
+static bool escape_pending;
+static std::deque<ScheduledByte> to_pic;
+static uint64_t to_pic_tail;
+static std::deque<ScheduledStatus> statuses;
+static std::vector<unsigned char> from_pic;
+static uint64_t from_pic_last;
+
+static struct {
+  unsigned long frames_in, frames_out, bad_frames, delivered, lost, asleep;
+} stats;
+
+static void write_frame(const std::vector<unsigned char> &data) {
+  std::vector<unsigned char> frame;
+  unsigned sum = 0;
+  frame.push_back(START_BYTE);
+  frame.push_back(data.size() >> 8);
+  frame.push_back(data.size() & 0xff);
+  for (unsigned i = 0; i < data.size(); i++) {
+    frame.push_back(data[i]);
+    sum += data[i];
+  }
+  frame.push_back(0xff - (sum & 0xff));
+  if (options.escaped) {
+    std::vector<unsigned char> escaped(1, START_BYTE);
+    for (unsigned i = 1; i < frame.size(); i++) {
+      unsigned char c = frame[i];
+      if (c == START_BYTE || c == ESCAPE || c == 0x11 || c == 0x13) {
+        escaped.push_back(ESCAPE);
+        c ^= 0x20;
+      }
+      escaped.push_back(c);
+    }
+    frame.swap(escaped);
+  }
+  // Nobody may be listening yet, so never block on the pty.
+  if (write(pty, &frame[0], frame.size()) != (ssize_t)frame.size()) {
+    if (sim_verbose)
+      sim_log("radio: server isn't reading, dropped a frame");
+    return;
+  }
+  stats.frames_out++;
+}
+
+// Sends what the radish's XBee has buffered as one RF packet.
+static void flush_from_pic(void) {
+  std::vector<unsigned char> data;
+  data.push_back(RECEIVE_PACKET);
+  data.insert(data.end(), address, address + 8);
+  data.push_back(options.rssi);
+  data.push_back(0);  // options
+  data.insert(data.end(), from_pic.begin(), from_pic.end());
+  if (sim_verbose >= 2)
+    sim_log("radio: %u bytes from radish, starting 0x%02x",
+            (unsigned)from_pic.size(), from_pic[0]);
+  write_frame(data);
+  from_pic.clear();
+}
+
+static void transmit_request(const unsigned char *data, unsigned length) {
+  if (length < 11)
+    return;
+  unsigned char frame_id = data[1];
+  const unsigned char *payload = data + 11;
+  unsigned payload_length = length - 11;
+  uint64_t airtime = (payload_length + AIR_OVERHEAD_BYTES) * AIR_BYTE_CYCLES;
+
+  unsigned char status = 0;
+  uint64_t done = sim_cycles + airtime + AIR_ACK_CYCLES;
+  if (radio_sleeping()) {
+    status = 1;  // No ACK
+    stats.asleep++;
+  } else if (options.loss_percent &&
+             rand() % 100 < options.loss_percent) {
+    status = 1;
+    stats.lost++;
+  }
+
+  if (status == 0) {
+    // The radish's XBee spits the payload out of its UART as soon as the
+    // packet arrives, behind anything it's still sending.
+    uint64_t at = sim_cycles + airtime;
+    if (at < to_pic_tail)
+      at = to_pic_tail;
+    for (unsigned i = 0; i < payload_length; i++) {
+      at += SERIAL_CHAR_CYCLES;
+      ScheduledByte b = {at, payload[i]};
+      to_pic.push_back(b);
+    }
+    to_pic_tail = at;
+    stats.delivered++;
+  } else {
+    done = sim_cycles + (AIR_RETRIES + 1) * (airtime + AIR_ACK_CYCLES * 4);
+  }
+  if (sim_verbose >= 2)
+    sim_log("radio: frame %u, %u bytes to radish%s", frame_id,
+            payload_length, status ? " (lost)" : "");
+
+  if (frame_id) {
+    ScheduledStatus s = {done, frame_id, status};
+    statuses.push_back(s);
+  }
+}
+
+static void handle_frame(const unsigned char *data, unsigned length) {
+  stats.frames_in++;
+  if (data[0] == TRANSMIT_REQUEST) {
+    transmit_request(data, length);
+  } else if (data[0] == AT_COMMAND && length >= 4) {
+    // Say OK to anything, so configuration scripts don't hang.
+    std::vector<unsigned char> response;
+    response.push_back(AT_RESPONSE);
+    response.push_back(data[1]);
+    response.push_back(data[2]);
+    response.push_back(data[3]);
+    response.push_back(0);
+    write_frame(response);
+  } else if (sim_verbose) {
+    sim_log("radio: ignoring API frame type 0x%02x", data[0]);
+  }
+}
+
+void radio_open(const RadioOptions &opts) {
+  options = opts;
+  for (unsigned i = 0; i < 8; i++) {
+    unsigned byte;
+    sscanf(opts.address + 2 * i, "%2x", &byte);
+    address[i] = byte;
+  }
+  srand(opts.seed);
+
+  pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (pty < 0 || grantpt(pty) || unlockpt(pty)) {
+    perror("posix_openpt");
+    exit(1);
+  }
+  const char *name = ptsname(pty);
+
+  // Hold the slave open so the pty doesn't hang up between server runs,
+  // and make it raw so nothing we write gets echoed back at us.
+  int slave = open(name, O_RDWR | O_NOCTTY);
+  struct termios tio;
+  if (slave < 0 || tcgetattr(slave, &tio)) {
+    perror(name);
+    exit(1);
+  }
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  if (opts.link) {
+    unlink(opts.link);
+    if (symlink(name, opts.link)) {
+      perror(opts.link);
+      exit(1);
+    }
+  }
+  fprintf(stderr, "XBee coordinator on %s\n", opts.link ? opts.link : name);
+}
+
+void radio_poll(void) {
+  unsigned char buffer[512];
+  ssize_t n;
+  while ((n = read(pty, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      unsigned char c = buffer[i];
+      if (options.escaped) {
+        if (c == ESCAPE) {
+          escape_pending = true;
+          continue;
+        }
+        if (escape_pending && c != START_BYTE)
+          c ^= 0x20;
+        escape_pending = false;
+      }
+      from_server.push_back(c);
+    }
+  }
+
+  unsigned used = 0;
+  while (used < from_server.size()) {
+    if (from_server[used] != START_BYTE) {
+      used++;
+      stats.bad_frames++;
+      continue;
+    }
+    if (from_server.size() - used < 3)
+      break;
+    unsigned length = (from_server[used + 1] << 8) | from_server[used + 2];
+    if (from_server.size() - used < length + 4)
+      break;
+    const unsigned char *data = &from_server[used + 3];
+    unsigned sum = 0;
+    for (unsigned i = 0; i <= length; i++)
+      sum += data[i];
+    if ((sum & 0xff) == 0xff && length > 0) {
+      handle_frame(data, length);
+      used += length + 4;
+    } else {
+      stats.bad_frames++;
+      used++;
+    }
+  }
+  from_server.erase(from_server.begin(), from_server.begin() + used);
+}
+
+void radio_tick(void) {
+  while (!to_pic.empty() && to_pic.front().at <= sim_cycles) {
+    uart_receive(to_pic.front().c);
+    to_pic.pop_front();
+  }
+
+  while (!statuses.empty() && statuses.front().at <= sim_cycles) {
+    std::vector<unsigned char> data;
+    data.push_back(TRANSMIT_STATUS);
+    data.push_back(statuses.front().frame_id);
+    data.push_back(statuses.front().status);
+    write_frame(data);
+    statuses.pop_front();
+  }
+
+  if (!from_pic.empty() &&
+      sim_cycles - from_pic_last >= PACKETIZATION_CHARS * SERIAL_CHAR_CYCLES)
+    flush_from_pic();
+}
+
+void radio_transmit(unsigned char c) {
+  if (radio_sleeping()) {
+    if (sim_verbose)
+      sim_log("radio: radish sent 0x%02x while its XBee was asleep", c);
+    return;
+  }
+  from_pic.push_back(c);
+  from_pic_last = sim_cycles;
+  if (from_pic.size() >= MAX_PAYLOAD)
+    flush_from_pic();
+}
+
+void radio_print_stats(void) {
+  fprintf(stderr,
+          "radio: %lu frames in, %lu out, %lu bad; %lu packets delivered, "
+          "%lu lost, %lu while asleep\n",
+          stats.frames_in, stats.frames_out, stats.bad_frames,
+          stats.delivered, stats.lost, stats.asleep);
+}
@@ -0,0 +1,707 @@
+/*
+Copyright 2009 Google Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// PIC16F690 emulation for running the radish firmware on a Linux host.
+//
+// This isn't an instruction set simulator. The firmware is compiled natively,
+// and time only moves forward when it touches a register, loops in
+// pause_msec(), or sleeps. That's close enough to reproduce the things that
+// matter for the radio protocol: the 2-byte UART FIFO and OERR, SPI transfers
+// to the display, the watchdog and its prescalers, and SLEEP. The simulated
+// clock is kept in step with the wall clock, so the real radio server can
+// talk to it.
+
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <vector>
+
+#include "core.h"
+#include "sim.h"
+
+// Rough cost of a register access, in instruction cycles. Most firmware
+// loops are a few instructions around each access.
+#define ACCESS_CYCLES 3
+
+#define STATUS_TO     0x10
+#define STATUS_PD     0x08
+#define PCON_POR      0x02
+#define INTCON_GIE    0x80
+#define INTCON_PEIE   0x40
+#define INTCON_RABIE  0x08
+#define INTCON_RABIF  0x01
+#define PIR1_RCIF     0x20
+#define PIR1_TXIF     0x10
+#define PIE1_RCIE     0x20
+#define RCSTA_SPEN    0x80
+#define RCSTA_CREN    0x10
+#define RCSTA_OERR    0x02
+#define TXSTA_TXEN    0x20
+#define TXSTA_TRMT    0x02
+#define SSPSTAT_BF    0x01
+#define SSPCON_SSPEN  0x20
+#define ADCON0_ADFM   0x80
+#define ADCON0_GO     0x02
+#define ADCON0_ADON   0x01
+#define WDTCON_SWDTEN 0x01
+#define OPTION_PSA    0x08
+#define PORTA_BUTTON  0x10
+#define PORTC_RADIO   0x01
+#define PORTC_RESET   0x02
+#define PORTC_BUSY    0x04
+#define PORTC_CS      0x08
+#define PORTC_TS      0x20
+
+#define LFINTOSC_HZ 31000
+#define LCD_RAM_SIZE 0x10000
+#define SCREEN_WIDTH 320
+#define SCREEN_HEIGHT 240
+#define SCREEN_BYTES (SCREEN_WIDTH * SCREEN_HEIGHT / 8)
+#define ADC_CYCLES 20
+#define BUTTON_CYCLES (CYCLES_PER_SEC / 5)
+// Getting into the interrupt handler and back out again, plus the context
+// saving the compiler wraps around it.
+#define INTERRUPT_CYCLES 20
+
+uint64_t sim_cycles;
+int sim_verbose;
+
+static unsigned char sfr[SFR_COUNT];
+
+static jmp_buf reset_jump;
+static bool asleep;
+static bool in_interrupt;
+static uint64_t awake_cycles;
+static uint64_t wdt_cleared;
+
+// Wall clock synchronisation. wall_base is the wall time, in uS, that
+// corresponds to sim_cycles == 0.
+static uint64_t wall_base;
+static uint64_t next_sync;
+static bool fast_sleep;
+static double run_limit;
+
+// UART
+static std::deque<unsigned char> rx_fifo;
+static bool tsr_busy;
+static unsigned char tsr;
+static uint64_t tsr_done;
+static bool txreg_full;
+static unsigned char txreg;
+
+// SPI and the display controller behind it
+static bool spi_busy;
+static unsigned char spi_byte;
+static uint64_t spi_done;
+static std::vector<unsigned char> lcd_ram(LCD_RAM_SIZE, 0xff);
+// What the panel shows, which only changes on a refresh.
+static std::vector<unsigned char> panel(SCREEN_BYTES, 0xff);
+static std::vector<unsigned char> lcd_command;
+static uint64_t lcd_busy_until;
+static unsigned lcd_refresh_ms = 500;
+static const char *screen_path = "radish_sim.pbm";
+
+// A/D converter and the things it measures
+static bool adc_busy;
+static uint64_t adc_done;
+static double vcap = 2.8;
+static double temp_c = 22;
+static bool temp_sensor = true;
+
+static volatile sig_atomic_t button_requested;
+static volatile sig_atomic_t stop_requested;
+static uint64_t button_release;
+
+static struct {
+  unsigned long power_on, wdt_resets, wdt_wakes, sleeps;
+  unsigned long rx_bytes, rx_dropped, overruns, tx_bytes, interrupts;
+  unsigned long lcd_commands, lcd_bytes, refreshes, partial_refreshes;
+} stats;
+
+static void tick(unsigned cycles);
+
+void sim_log(const char *format, ...) {
+  va_list args;
+  fprintf(stderr, "[%12.3f] ", sim_cycles / 1000.0);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+static uint64_t wall_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool radio_sleeping(void) {
+  return (sfr[SFR_PORTC] & PORTC_RADIO) && !(sfr[SFR_TRISC] & PORTC_RADIO);
+}
+
+// Watchdog period in cycles. The WDT postscaler is 2^(5 + WDTPS), and the
+// TMR0 prescaler adds another 2^PS when it's assigned to the WDT.
+static uint64_t wdt_period(void) {
+  unsigned exponent = 5 + ((sfr[SFR_WDTCON] >> 1) & 0x0f);
+  if (sfr[SFR_OPTION] & OPTION_PSA)
+    exponent += sfr[SFR_OPTION] & 0x07;
+  return ((uint64_t)CYCLES_PER_SEC << exponent) / LFINTOSC_HZ;
+}
+
+// Cycles per UART character (start + 8 data + stop) at the programmed rate,
+// assuming BRGH = 1 and BRG16 = 1 like radio_init() sets up.
+static unsigned uart_char_cycles(void) {
+  unsigned brg = sfr[SFR_SPBRG] | (sfr[SFR_SPBRGH] << 8);
+  return 10 * (brg + 1);
+}
+
+static unsigned spi_bit_cycles(void) {
+  switch (sfr[SFR_SSPCON] & 0x0f) {
+    case 0: return 1;   // FOSC/4
+    case 1: return 4;   // FOSC/16
+    default: return 16; // FOSC/64
+  }
+}
+
+void uart_receive(unsigned char c) {
+  if (asleep || !(sfr[SFR_RCSTA] & RCSTA_SPEN) ||
+      !(sfr[SFR_RCSTA] & RCSTA_CREN) || (sfr[SFR_RCSTA] & RCSTA_OERR)) {
+    stats.rx_dropped++;
+    if (sim_verbose >= 2)
+      sim_log("uart: dropped 0x%02x", c);
+    return;
+  }
+  // Two bytes in the FIFO, and this one is in the shift register. Once its
+  // stop bit arrives there's nowhere for it to go.
+  if (rx_fifo.size() >= 2) {
+    sfr[SFR_RCSTA] |= RCSTA_OERR;
+    stats.overruns++;
+    if (sim_verbose)
+      sim_log("uart: overrun, dropped 0x%02x", c);
+    return;
+  }
+  rx_fifo.push_back(c);
+  stats.rx_bytes++;
+}
+
+static void uart_reset(void) {
+  rx_fifo.clear();
+  sfr[SFR_RCSTA] &= ~RCSTA_OERR;
+  tsr_busy = false;
+  txreg_full = false;
+}
+
+static void write_screen(void) {
+  char tmp[1024];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", screen_path);
+  FILE *f = fopen(tmp, "wb");
+  if (!f) {
+    sim_log("lcd: can't write %s: %s", tmp, strerror(errno));
+    return;
+  }
+  // PBM is 1 = black, the display RAM is 1 = white.
+  fprintf(f, "P4\n320 240\n");
+  for (unsigned i = 0; i < SCREEN_BYTES; i++)
+    fputc(~panel[i] & 0xff, f);
+  fclose(f);
+  rename(tmp, screen_path);
+}
+
+static unsigned command_word(unsigned i) {
+  return (lcd_command[i] << 8) | lcd_command[i + 1];
+}
+
+// Acts on a command once /CS goes back high.
+static void lcd_execute(void) {
+  if (lcd_command.empty())
+    return;
+  stats.lcd_commands++;
+  unsigned length = lcd_command.size();
+  switch (lcd_command[0]) {
+    case 0x00:  // Write to memory
+      if (length >= 3) {
+        unsigned address = command_word(1);
+        for (unsigned i = 3; i < length; i++)
+          lcd_ram[(address + i - 3) & (LCD_RAM_SIZE - 1)] = lcd_command[i];
+        if (sim_verbose >= 2)
+          sim_log("lcd: write %u bytes at 0x%04x", length - 3, address);
+      }
+      break;
+    case 0x01:  // Fill memory
+      if (length >= 6) {
+        unsigned start = command_word(1), end = command_word(3);
+        for (unsigned i = start; i <= end; i++)
+          lcd_ram[i & (LCD_RAM_SIZE - 1)] = lcd_command[5];
+        if (sim_verbose >= 2)
+          sim_log("lcd: fill 0x%04x-0x%04x with 0x%02x", start, end,
+                  lcd_command[5]);
+      }
+      break;
+    case 0x10:  // Clear display bright
+    case 0x12:  // Clear display dark
+      lcd_busy_until = sim_cycles + lcd_refresh_ms * 1000ULL;
+      if (sim_verbose)
+        sim_log("lcd: clear display");
+      break;
+    case 0x18:  // Display full screen
+      if (length >= 3) {
+        unsigned start = command_word(1);
+        for (unsigned i = 0; i < SCREEN_BYTES; i++)
+          panel[i] = lcd_ram[(start + i) & (LCD_RAM_SIZE - 1)];
+        write_screen();
+        lcd_busy_until = sim_cycles + lcd_refresh_ms * 1000ULL;
+        stats.refreshes++;
+        if (sim_verbose)
+          sim_log("lcd: display full screen from 0x%04x", start);
+      }
+      break;
+    case 0x19:  // Display area
+      if (length >= 11) {
+        unsigned start = command_word(1);
+        unsigned x0 = command_word(3) / 8, y0 = command_word(5);
+        unsigned x1 = command_word(7) / 8, y1 = command_word(9);
+        if (x1 >= SCREEN_WIDTH / 8)
+          x1 = SCREEN_WIDTH / 8 - 1;
+        if (y1 >= SCREEN_HEIGHT)
+          y1 = SCREEN_HEIGHT - 1;
+        for (unsigned y = y0; y <= y1; y++) {
+          for (unsigned x = x0; x <= x1; x++) {
+            unsigned i = y * (SCREEN_WIDTH / 8) + x;
+            panel[i] = lcd_ram[(start + i) & (LCD_RAM_SIZE - 1)];
+          }
+        }
+        write_screen();
+        // Guess that the refresh time goes with the number of rows.
+        unsigned rows = y1 >= y0 ? y1 - y0 + 1 : 0;
+        lcd_busy_until = sim_cycles +
+            lcd_refresh_ms * 1000ULL * rows / SCREEN_HEIGHT;
+        stats.partial_refreshes++;
+        if (sim_verbose)
+          sim_log("lcd: display area %u,%u-%u,%u", command_word(3), y0,
+                  command_word(7), y1);
+      }
+      break;
+    case 0x20:  // Sleep
+      break;
+    default:
+      sim_log("lcd: unknown command 0x%02x (%u bytes)", lcd_command[0],
+              length);
+      break;
+  }
+  lcd_command.clear();
+}
+
+static void adc_finish(void) {
+  unsigned channel = (sfr[SFR_ADCON0] >> 2) & 0x0f;
+  double volts = 0;
+  if (channel == 2) {
+    volts = vcap;
+  } else if (channel == 8 && temp_sensor && (sfr[SFR_PORTC] & PORTC_TS)) {
+    volts = (temp_c + 50) * 0.01;  // .01V/degree C, 0V = -50C
+  }
+  // Vref is 3.02V
+  unsigned value = volts <= 0 ? 0 : (unsigned)(volts / 3.02 * 1023 + 0.5);
+  if (value > 1023)
+    value = 1023;
+  if (sfr[SFR_ADCON0] & ADCON0_ADFM) {
+    sfr[SFR_ADRESH] = value >> 8;
+    sfr[SFR_ADRESL] = value & 0xff;
+  } else {
+    sfr[SFR_ADRESH] = value >> 2;
+    sfr[SFR_ADRESL] = (value & 3) << 6;
+  }
+  sfr[SFR_ADCON0] &= ~ADCON0_GO;
+  adc_busy = false;
+}
+
+static void reset_registers(void) {
+  // Port latches are undefined at reset. Everything comes up as an input.
+  sfr[SFR_TRISA] = sfr[SFR_TRISB] = sfr[SFR_TRISC] = 0xff;
+  sfr[SFR_ANSEL] = 0xff;
+  sfr[SFR_ANSELH] = 0x0f;
+  sfr[SFR_OPTION] = 0xff;
+  sfr[SFR_WDTCON] = 0x08;
+  sfr[SFR_INTCON] = 0;
+  sfr[SFR_PIE1] = 0;
+  sfr[SFR_RCSTA] = 0;
+  sfr[SFR_TXSTA] = TXSTA_TRMT;
+  sfr[SFR_SSPCON] = 0;
+  sfr[SFR_SSPSTAT] = 0;
+  sfr[SFR_ADCON0] = 0;
+  sfr[SFR_IOCA] = 0;
+  uart_reset();
+  spi_busy = false;
+  adc_busy = false;
+  asleep = false;
+  in_interrupt = false;
+  wdt_cleared = sim_cycles;
+}
+
+static void device_reset(const char *why) {
+  if (sim_verbose)
+    sim_log("pic: reset (%s)", why);
+  longjmp(reset_jump, 1);
+}
+
+// Keeps the simulated clock from running ahead of the wall clock, and picks
+// up whatever the server has sent.
+static void sync_wall_clock(void) {
+  uint64_t now = wall_usec();
+  if (sim_cycles > now - wall_base + 1000)
+    usleep(sim_cycles - (now - wall_base));
+  radio_poll();
+  next_sync = sim_cycles + 1000;
+
+  if (button_requested) {
+    button_requested = 0;
+    button_release = sim_cycles + BUTTON_CYCLES;
+    sfr[SFR_PORTA] |= PORTA_BUTTON;
+    if (sfr[SFR_IOCA] & PORTA_BUTTON)
+      sfr[SFR_INTCON] |= INTCON_RABIF;
+    if (sim_verbose)
+      sim_log("pic: button pressed");
+  }
+  if (stop_requested || (run_limit && sim_cycles >= run_limit * 1e6)) {
+    radio_print_stats();
+    exit(0);
+  }
+}
+
+// Advances the clock and everything that runs off it.
+static void tick(unsigned cycles) {
+  sim_cycles += cycles;
+  if (!asleep)
+    awake_cycles += cycles;
+
+  if (tsr_busy && sim_cycles >= tsr_done) {
+    radio_transmit(tsr);
+    stats.tx_bytes++;
+    tsr_busy = false;
+    if (txreg_full) {
+      tsr = txreg;
+      txreg_full = false;
+      tsr_busy = true;
+      tsr_done = sim_cycles + uart_char_cycles();
+    }
+  }
+
+  if (spi_busy && sim_cycles >= spi_done) {
+    spi_busy = false;
+    sfr[SFR_SSPSTAT] |= SSPSTAT_BF;
+    if (!(sfr[SFR_PORTC] & PORTC_CS)) {
+      lcd_command.push_back(spi_byte);
+      stats.lcd_bytes++;
+    }
+  }
+
+  if (adc_busy && sim_cycles >= adc_done)
+    adc_finish();
+
+  if (button_release && sim_cycles >= button_release) {
+    button_release = 0;
+    sfr[SFR_PORTA] &= ~PORTA_BUTTON;
+    if (sfr[SFR_IOCA] & PORTA_BUTTON)
+      sfr[SFR_INTCON] |= INTCON_RABIF;
+  }
+
+  radio_tick();
+
+  if ((sfr[SFR_WDTCON] & WDTCON_SWDTEN) &&
+      sim_cycles - wdt_cleared >= wdt_period()) {
+    wdt_cleared = sim_cycles;
+    if (asleep) {
+      // Wake up and carry on after the SLEEP instruction
+      asleep = false;
+      sfr[SFR_STATUS] &= ~STATUS_TO;
+      stats.wdt_wakes++;
+    } else {
+      sfr[SFR_STATUS] = (sfr[SFR_STATUS] & ~STATUS_TO) | STATUS_PD;
+      stats.wdt_resets++;
+      device_reset("watchdog");
+    }
+  }
+
+  if (sim_cycles >= next_sync)
+    sync_wall_clock();
+}
+
+// Runs the interrupt handler if an enabled interrupt is pending. The PIC
+// checks between instructions; we check before each register access.
+static void check_interrupts(void) {
+  unsigned char intcon = sfr[SFR_INTCON];
+  if (in_interrupt || !(intcon & INTCON_GIE))
+    return;
+  bool uart = (intcon & INTCON_PEIE) && (sfr[SFR_PIE1] & PIE1_RCIE) &&
+              !rx_fifo.empty();
+  bool change = (intcon & INTCON_RABIE) && (intcon & INTCON_RABIF);
+  if (!uart && !change)
+    return;
+  in_interrupt = true;
+  stats.interrupts++;
+  sfr[SFR_INTCON] &= ~INTCON_GIE;
+  tick(INTERRUPT_CYCLES);
+  isr();
+  sfr[SFR_INTCON] |= INTCON_GIE;  // RETFIE
+  in_interrupt = false;
+}
+
+unsigned char sim_read(unsigned addr) {
+  check_interrupts();
+  tick(ACCESS_CYCLES);
+  switch (addr) {
+    case SFR_PIR1:
+      sfr[addr] &= ~(PIR1_RCIF | PIR1_TXIF);
+      if (!rx_fifo.empty())
+        sfr[addr] |= PIR1_RCIF;
+      if (!txreg_full)
+        sfr[addr] |= PIR1_TXIF;
+      break;
+    case SFR_RCREG:
+      if (!rx_fifo.empty()) {
+        sfr[addr] = rx_fifo.front();
+        rx_fifo.pop_front();
+      }
+      break;
+    case SFR_TXSTA:
+      sfr[addr] &= ~TXSTA_TRMT;
+      if (!tsr_busy && !txreg_full)
+        sfr[addr] |= TXSTA_TRMT;
+      break;
+    case SFR_PORTC:
+      sfr[addr] &= ~PORTC_BUSY;
+      if (sim_cycles < lcd_busy_until)
+        sfr[addr] |= PORTC_BUSY;
+      break;
+  }
+  return sfr[addr];
+}
+
+void sim_write(unsigned addr, unsigned char value) {
+  check_interrupts();
+  tick(ACCESS_CYCLES);
+  unsigned char old = sfr[addr];
+  sfr[addr] = value;
+  switch (addr) {
+    case SFR_TXREG:
+      if (!(sfr[SFR_RCSTA] & RCSTA_SPEN) || !(sfr[SFR_TXSTA] & TXSTA_TXEN))
+        break;
+      if (!tsr_busy) {
+        tsr = value;
+        tsr_busy = true;
+        tsr_done = sim_cycles + uart_char_cycles();
+      } else {
+        txreg = value;
+        txreg_full = true;
+      }
+      break;
+    case SFR_RCSTA:
+      // Clearing SPEN or CREN resets the receiver, including OERR.
+      if (!(value & RCSTA_SPEN) || !(value & RCSTA_CREN)) {
+        rx_fifo.clear();
+        sfr[addr] &= ~RCSTA_OERR;
+      } else {
+        sfr[addr] = (sfr[addr] & ~RCSTA_OERR) | (old & RCSTA_OERR);
+      }
+      if (!(value & RCSTA_SPEN))
+        tsr_busy = txreg_full = false;
+      break;
+    case SFR_SSPCON:
+      // Clearing SSPEN resets the MSSP, throwing away any byte in flight.
+      if (!(value & SSPCON_SSPEN)) {
+        sfr[SFR_SSPSTAT] &= ~SSPSTAT_BF;
+        spi_busy = false;
+      }
+      break;
+    case SFR_SSPBUF:
+      sfr[SFR_SSPSTAT] &= ~SSPSTAT_BF;
+      spi_byte = value;
+      spi_busy = true;
+      spi_done = sim_cycles + 8 * spi_bit_cycles();
+      break;
+    case SFR_PORTC:
+      if ((old & PORTC_CS) && !(value & PORTC_CS))
+        lcd_command.clear();
+      if (!(old & PORTC_CS) && (value & PORTC_CS))
+        lcd_execute();
+      if ((old & PORTC_RESET) && !(value & PORTC_RESET)) {
+        // The controller keeps its RAM across a reset.
+        lcd_command.clear();
+        lcd_busy_until = 0;
+      }
+      break;
+    case SFR_ADCON0:
+      if ((value & ADCON0_GO) && (value & ADCON0_ADON) && !adc_busy) {
+        adc_busy = true;
+        adc_done = sim_cycles + ADC_CYCLES;
+      }
+      break;
+    case SFR_WDTCON:
+      if (!(old & WDTCON_SWDTEN) && (value & WDTCON_SWDTEN))
+        wdt_cleared = sim_cycles;
+      break;
+  }
+}
+
+void sim_nop(void) {
+  check_interrupts();
+  tick(1);
+}
+
+void sim_delay_loop(void) {
+  tick(4);
+}
+
+void sim_clrwdt(void) {
+  tick(1);
+  wdt_cleared = sim_cycles;
+  sfr[SFR_STATUS] |= STATUS_TO | STATUS_PD;
+}
+
+void sim_sleep(void) {
+  tick(1);
+  // A pending, enabled interrupt-on-change makes SLEEP a NOP.
+  if ((sfr[SFR_INTCON] & INTCON_RABIE) && (sfr[SFR_INTCON] & INTCON_RABIF))
+    return;
+
+  stats.sleeps++;
+  wdt_cleared = sim_cycles;
+  sfr[SFR_STATUS] = (sfr[SFR_STATUS] | STATUS_TO) & ~STATUS_PD;
+  asleep = true;
+  uint64_t start = sim_cycles;
+  if (sim_verbose >= 2)
+    sim_log("pic: sleep (wdt %s, %.1fs)",
+            sfr[SFR_WDTCON] & WDTCON_SWDTEN ? "on" : "off",
+            (double)wdt_period() / CYCLES_PER_SEC);
+
+  while (asleep) {
+    if ((sfr[SFR_INTCON] & INTCON_RABIE) &&
+        (sfr[SFR_INTCON] & INTCON_RABIF)) {
+      asleep = false;
+      break;
+    }
+    // Skip ahead in big steps, since nothing on the PIC is clocked. With
+    // fast sleep, the wall clock gets dragged along so we don't wait.
+    unsigned step = 1000;
+    if (fast_sleep)
+      wall_base -= step;
+    tick(step);
+  }
+  if (sim_verbose >= 2)
+    sim_log("pic: woke after %.1fs",
+            (double)(sim_cycles - start) / CYCLES_PER_SEC);
+}
+
+static void print_stats(void) {
+  fprintf(stderr,
+          "simulated %.1fs, awake %.3fs\n"
+          "resets: %lu power on, %lu watchdog; %lu sleeps, %lu wdt wakes\n"
+          "uart: %lu bytes in, %lu dropped, %lu overruns, %lu bytes out, "
+          "%lu interrupts\n"
+          "lcd: %lu commands, %lu bytes, %lu refreshes, %lu partial\n",
+          (double)sim_cycles / CYCLES_PER_SEC,
+          (double)awake_cycles / CYCLES_PER_SEC,
+          stats.power_on, stats.wdt_resets, stats.sleeps, stats.wdt_wakes,
+          stats.rx_bytes, stats.rx_dropped, stats.overruns, stats.tx_bytes,
+          stats.interrupts,
+          stats.lcd_commands, stats.lcd_bytes, stats.refreshes,
+          stats.partial_refreshes);
+}
+
+static void on_signal(int signum) {
+  if (signum == SIGUSR1)
+    button_requested = 1;
+  else
+    stop_requested = 1;
+}
+
+// Prints the options, to stdout if they were asked for with -h, and exits.
+static void usage(const char *argv0, int status) {
+  fprintf(status ? stderr : stdout,
+          "Usage: %s [options]\n"
+          "  -l LINK     symlink LINK to the pty the server should open\n"
+          "  -a ADDRESS  64-bit address of the radish (default %s)\n"
+          "  -V VOLTS    capacitor voltage (default %.2f)\n"
+          "  -T DEGREES  temperature in Celsius, or 'none' for no sensor\n"
+          "  -r RSSI     signal strength to report, in -dBm (default 40)\n"
+          "  -p PERCENT  chance of losing each packet sent to the radish\n"
+          "  -S SEED     random seed for packet loss\n"
+          "  -e          escaped API mode (AP=2) on the pty\n"
+          "  -s FILE     where to write the displayed image (default %s)\n"
+          "  -R MSEC     display refresh time (default %u)\n"
+          "  -f          don't wait in real time while the PIC sleeps\n"
+          "  -t SECONDS  exit after this much simulated time\n"
+          "  -v          more logging; repeat for even more\n"
+          "  -h          show this help\n"
+          "Send SIGUSR1 to press the app button.\n",
+          argv0, "0013a20040000001", vcap, screen_path, lcd_refresh_ms);
+  exit(status);
+}
+
+int main(int argc, char **argv) {
+  RadioOptions radio = {NULL, "0013a20040000001", 40, 0, 1, false};
+  int opt;
+  while ((opt = getopt(argc, argv, "l:a:V:T:r:p:S:es:R:ft:vh")) != -1) {
+    switch (opt) {
+      case 'l': radio.link = optarg; break;
+      case 'a': radio.address = optarg; break;
+      case 'V': vcap = atof(optarg); break;
+      case 'T':
+        temp_sensor = strcmp(optarg, "none") != 0;
+        temp_c = atof(optarg);
+        break;
+      case 'r': radio.rssi = atoi(optarg); break;
+      case 'p': radio.loss_percent = atoi(optarg); break;
+      case 'S': radio.seed = atoi(optarg); break;
+      case 'e': radio.escaped = true; break;
+      case 's': screen_path = optarg; break;
+      case 'R': lcd_refresh_ms = atoi(optarg); break;
+      case 'f': fast_sleep = true; break;
+      case 't': run_limit = atof(optarg); break;
+      case 'v': sim_verbose++; break;
+      case 'h': usage(argv[0], 0);
+      default: usage(argv[0], 2);
+    }
+  }
+  if (optind != argc || strlen(radio.address) != 16)
+    usage(argv[0], 2);
+
+  signal(SIGUSR1, on_signal);
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  atexit(print_stats);
+
+  radio_open(radio);
+  wall_base = wall_usec();
+
+  // Power-on reset
+  sfr[SFR_STATUS] = STATUS_TO | STATUS_PD;
+  sfr[SFR_PCON] = 0;
+  stats.power_on++;
+
+  // The firmware never returns from main; resets longjmp back here.
+  setjmp(reset_jump);
+  reset_registers();
+  radish_main();
+  return 0;
+}
@@ -0,0 +1,75 @@
+/*
+Copyright 2009 Google Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Interface between the emulated pic.h and the simulator core. Nothing in
+// here may pull in the C library headers, since the firmware defines its own
+// getc() and putc().
+
+#ifndef HARDWARE_SIGNAGE_DISPLAY_SIM_SIM_H__
+#define HARDWARE_SIGNAGE_DISPLAY_SIM_SIM_H__
+
+// Special function register addresses, as on the PIC16F690.
+#define SFR_STATUS   0x003
+#define SFR_PORTA    0x005
+#define SFR_PORTB    0x006
+#define SFR_PORTC    0x007
+#define SFR_INTCON   0x00B
+#define SFR_PIR1     0x00C
+#define SFR_SSPBUF   0x013
+#define SFR_SSPCON   0x014
+#define SFR_RCSTA    0x018
+#define SFR_TXREG    0x019
+#define SFR_RCREG    0x01A
+#define SFR_ADRESH   0x01E
+#define SFR_ADCON0   0x01F
+#define SFR_OPTION   0x081
+#define SFR_TRISA    0x085
+#define SFR_TRISB    0x086
+#define SFR_TRISC    0x087
+#define SFR_PIE1     0x08C
+#define SFR_PCON     0x08E
+#define SFR_SSPSTAT  0x094
+#define SFR_IOCA     0x096
+#define SFR_WDTCON   0x097
+#define SFR_TXSTA    0x098
+#define SFR_SPBRG    0x099
+#define SFR_SPBRGH   0x09A
+#define SFR_BAUDCTL  0x09B
+#define SFR_ADRESL   0x09E
+#define SFR_ADCON1   0x09F
+#define SFR_ANSEL    0x11E
+#define SFR_ANSELH   0x11F
+#define SFR_COUNT    0x200
+
+// Every SFR access goes through these, so the simulator can apply side
+// effects (popping the UART FIFO, starting an SPI transfer...) and advance
+// the cycle counter.
+unsigned char sim_read(unsigned addr);
+void sim_write(unsigned addr, unsigned char value);
+
+void sim_nop(void);
+void sim_clrwdt(void);
+void sim_sleep(void);
+void sim_delay_loop(void);
+
+// The firmware's entry point, renamed from main() by pic.h.
+void radish_main(void);
+
+// The firmware's interrupt handler. It's called between register accesses
+// whenever an enabled interrupt is pending, with GIE cleared like on the PIC.
+void isr(void);
+
+#endif  // HARDWARE_SIGNAGE_DISPLAY_SIM_SIM_H__
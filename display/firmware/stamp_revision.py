@@ -1,4 +1,4 @@
-#!/usr/bin/python2.4
+#!/usr/bin/env python
 #
 # Copyright 2009 Google Inc.
 #
@@ -23,12 +23,11 @@ the firmware revision. The IDLOC macro programs the ID location in the pic,
 which can be read by programmers and debuggers.
 """
 
-import sre
-import struct
+import re
 import sys
 
 # Example: "// $Revision: #5 $"
-pattern = sre.compile(".*\\$Revision:\\s*#(\\d+)\\s*\\$")
+pattern = re.compile(".*\\$Revision:\\s*#(\\d+)\\s*\\$")
 revision = -1
 
 for line in sys.stdin:
@@ -37,7 +36,9 @@ for line in sys.stdin:
     # Add one, because that's the revision it'll be when committed
     revision = int(match.group(1)) + 1
 
-revision_string = struct.pack("<h", revision)
+# Little-endian 16 bits, as struct.pack("<h") would give.
+revision_low = revision & 0xff
+revision_high = (revision >> 8) & 0xff
 output = """
 #ifndef HARDWARE_SIGNAGE_DISPLAY_REVISION_H__
 #define HARDWARE_SIGNAGE_DISPLAY_REVISION_H__
@@ -50,6 +51,6 @@ output = """
 __IDLOC(%04X);
 
 #endif  // HARDWARE_SIGNAGE_DISPLAY_REVISION_H__
-""" % (ord(revision_string[0]), ord(revision_string[1]), revision)
+""" % (revision_low, revision_high, revision)
 
 sys.stdout.write(output)
@@ -17,8 +17,46 @@ limitations under the License.
 #include <pic.h>
 #include "pause.h"
 #include "main.h"
+#include "xbee.h"
 
 #define RADIO_SLEEP RC0
+
+// Received bytes, put here by the interrupt handler and taken out by getc().
+// This has to be a power of two. PacketPlanner::RX_BUFFER on the server
+// counts on it being this big.
+#define RX_BUFFER_SIZE 32
+unsigned char rx_buffer[RX_BUFFER_SIZE];
+volatile unsigned char rx_head;  // Only the interrupt handler writes this
+volatile unsigned char rx_tail;  // Only getc() writes this
+volatile unsigned char rx_overruns;
+
+void interrupt isr(void) {
+  unsigned char next;
+
+  // Take everything in the FIFO, so we don't come straight back.
+  while (RCIF) {
+    if (OERR) {
+      // The FIFO filled up before we got here. Resetting the receiver is the
+      // only way to get it going again, and loses what was in the FIFO.
+      CREN = 0;
+      CREN = 1;
+      if (rx_overruns != 255)
+        rx_overruns++;
+      break;
+    }
+    // The slot at rx_head is always free, even when the buffer's full.
+    rx_buffer[rx_head] = RCREG;
+    next = (rx_head + 1) & (RX_BUFFER_SIZE - 1);
+    if (next == rx_tail) {
+      // Buffer's full, so drop the byte. The transfer will fail anyway.
+      if (rx_overruns != 255)
+        rx_overruns++;
+    } else {
+      rx_head = next;
+    }
+  }
+}
+
 void putc(unsigned char c){
   while (!TXIF); // Wait until output buffer is available
   TXREG = c;
@@ -26,15 +64,38 @@ void putc(unsigned char c){
 
 // blocks
 unsigned char getc(void){
-  while(!RCIF); // Wait until we have a char
+  unsigned char c;
+
+  // Wait until we have a char. The NOP is where the simulator gets to run
+  // the interrupt handler; on the PIC it's just one more cycle.
+  while (rx_head == rx_tail)
+    NOP();
   // Turn off the led when we get a byte. This allows us to quickly
   // see the round trip time for a packet, and it saves energy.
   CLRWDT();
-  return RCREG;
+  c = rx_buffer[rx_tail];
+  rx_tail = (rx_tail + 1) & (RX_BUFFER_SIZE - 1);
+  return c;
+}
+
+void rx_start(void){
+  rx_head = 0;
+  rx_tail = 0;
+  rx_overruns = 0;
+  // The handler only knows about the UART, so don't let a button press
+  // get it called.
+  RABIE = 0;
+  RCIE = 1;
+  PEIE = 1;
+  GIE = 1;
 }
 
 // set to 1 to sleep, 0 to wake
 void radio_sleep(void){
+  // Back to wake-on-change only, like init_ports() left it.
+  GIE = 0;
+  RCIE = 0;
+  RABIE = 1;
   while (!TRMT); // Wait until output buffer is eMpTy
   RADIO_SLEEP = 1;
   SPEN = 0;
@@ -17,6 +17,10 @@ limitations under the License.
 #ifndef HARDWARE_SIGNAGE_DISPLAY_XBEE_H__
 #define HARDWARE_SIGNAGE_DISPLAY_XBEE_H__
 
+// Overruns since rx_start(), when the receive buffer or the UART's FIFO
+// was full and a byte got lost, up to 255.
+extern volatile unsigned char rx_overruns;
+
 // Function Prototypes
 
 unsigned char getc(void);
@@ -24,5 +28,8 @@ void putc(unsigned char c);
 void radio_sleep(void);
 void radio_wake(void);
 void radio_flush(void);
+// Hands reception over to the interrupt handler, which buffers bytes for
+// getc(). radio_sleep() hands it back.
+void rx_start(void);
 
 #endif  // HARDWARE_SIGNAGE_DISPLAY_XBEE_H__
@@ -14,10 +14,12 @@
 # limitations under the License.
 
 require 'threaded_queue'
+require 'frame_decoder'
 
 module Radish
   module Ascii
     NUL = "\000" # padding to flush xbee output buffer
+    SOH = "\001" # session options
     STX = "\002" # server start tansfer
     ETX = "\003" # server end transfer
     EOT = "\004" # End of Transfer (currently not used)
@@ -59,9 +61,149 @@ module Radish
       end
     end
 
+    # A TRANSMIT_REQUEST frame put together ahead of time, so that sending
+    # it only means filling in the frame ID, destination and sequence number
+    # and fixing up the checksum.
+    class Frame
+      FRAME_ID_OFFSET = 4
+      DESTINATION_OFFSET = 5
+      SEQUENCE_OFFSET = 15
+
+      # What goes to the radish, not counting the header and sequence number.
+      attr_reader :payload
+
+      # header is STX, ETX or SOH, and is followed by a sequence number. Raw
+      # packets have neither.
+      def initialize(payload, header = nil)
+        @payload = payload
+        body = header ? [header, 0, payload].pack('a1Ca*') : payload
+        data = [TRANSMIT_REQUEST, 0, '', 0, body].pack('CCa8Ca*')
+        @frame = [START_BYTE, data.length, data, 0].pack('Cna*C')
+        @sum = data.sum(8)
+      end
+
+      def length
+        @payload.length
+      end
+
+      # Returns the frame as it goes to the XBee. destination is the packed
+      # 64-bit address.
+      def build(frame_id, destination, seq = nil)
+        frame = @frame.dup
+        frame[FRAME_ID_OFFSET, 1] = frame_id.chr
+        frame[DESTINATION_OFFSET, 8] = destination
+        sum = @sum + frame_id + destination.sum(8)
+        if seq
+          # The radish counts in a byte, so a transfer of pages that takes
+          # more than 256 packets wraps around.
+          seq &= 0xFF
+          frame[SEQUENCE_OFFSET, 1] = seq.chr
+          sum += seq
+        end
+        frame[-1, 1] = (0xFF - (sum & 0xFF)).chr
+        frame
+      end
+    end
+
+    # What we've learned about the radio link to one radish. It outlives the
+    # responses sent over it, so each new response starts out with a window
+    # that suits the link.
+    class Link
+      # Packets in flight when we don't know anything about the link yet
+      DEFAULT_WINDOW = 2.0
+      # The radish's XBee can only buffer a few packets on its way to the
+      # PIC, so more than this in flight doesn't buy anything.
+      MAX_WINDOW = 8.0
+      # Time for the radish to drain a full packet out of its XBee's UART:
+      # 100 bytes of 10 bits at 57600 baud.
+      DRAIN_TIME = 100 * 10 / 57600.0
+      # Weight given to each new sample in the moving averages.
+      SMOOTHING = 0.125
+
+      # Window the last response finished with
+      attr_accessor :window
+
+      # Request-to-response time the radish measured, from its
+      # TIMING_REPORT, in seconds.
+      attr_accessor :rtt
+
+      # Moving average of the time between sending a packet and the XBee
+      # telling us whether it got there, in seconds.
+      attr_reader :status_latency
+
+      # Moving average of the fraction of packets that didn't get there.
+      attr_reader :nak_rate
+
+      def initialize
+        @window = DEFAULT_WINDOW
+        @rtt = nil
+        @status_latency = nil
+        @nak_rate = 0.0
+      end
+
+      def status(latency, ok)
+        @status_latency = average(@status_latency, latency)
+        @nak_rate = average(@nak_rate, ok ? 0.0 : 1.0)
+      end
+
+      # The radish told us its UART overran, so we were going too fast.
+      def overrun
+        @window = [@window / 2, 1.0].max
+      end
+
+      # The most packets worth having in flight: enough to keep the radish
+      # busy while we wait to hear back about the oldest one.
+      def limit
+        return MAX_WINDOW if @status_latency.nil? and @rtt.nil?
+        delay = (@status_latency || 0) + (@rtt || 0) / 2
+        [[(delay / DRAIN_TIME).ceil + 1, 2].max, MAX_WINDOW].min.to_f
+      end
+
+      # Window for a new response. A lossy link starts off smaller, since
+      # every NAK rewinds everything in flight.
+      def initial_window
+        [[@window * (1 - @nak_rate), 1.0].max, limit].min
+      end
+
+      # What's worth remembering across restarts.
+      def state
+        {'window' => @window, 'rtt' => @rtt,
+         'status_latency' => @status_latency, 'nak_rate' => @nak_rate}
+      end
+
+      # Picks up where a Link with this state left off.
+      def restore(state)
+        @window = state['window'] if state['window']
+        @rtt = state['rtt']
+        @status_latency = state['status_latency']
+        @nak_rate = state['nak_rate'] || 0.0
+      end
+
+      def report
+        report = {'window' => '%.1f' % @window,
+                  'nak_rate' => '%.2f' % @nak_rate}
+        if @status_latency
+          report['status_ms'] = '%.1f' % (@status_latency * 1000)
+        end
+        report['rtt_ms'] = '%.1f' % (@rtt * 1000) if @rtt
+        report
+      end
+
+      private
+
+      def average(old, sample)
+        return sample if old.nil?
+        old + SMOOTHING * (sample - old)
+      end
+    end
+
     # Contains the data needed to make a response to a Radish.
     # Return one of these from the dispatch block.
     class Response
+      # After sending its request, the radish waits about this long for the
+      # first byte of the response before its watchdog resets it.
+      WATCHDOG_WINDOW = 0.132
+
       # Whether the data should be sent raw, without massaging it into the
       # proper format.
       attr_accessor :raw
@@ -76,15 +218,25 @@ module Radish
       # A list of data to be sent in each phase. All the packets in one phase
       # are guaranteed to be acted upon before any packets in later phases. The
       # format is a list of lists of strings, where the strings are data
-      # packets, and the list at index N is the data for phase N.
+      # packets, and the list at index N is the data for phase N. Packets may
+      # also be Frames that were put together ahead of time.
       attr_reader :phase_data
 
       # The number of seconds the radish should sleep after receiving this
       # response.
       attr_reader :sleep_time
 
+      # How fast the radish's sleep clock runs, relative to 31kHz. See
+      # ClockCalibration.
+      attr_accessor :clock
+
+      # The page schedule that goes after the sleep time in the ETX, for
+      # radishes that were sent OPT_PAGES, or nil. See
+      # PacketPlanner.page_schedule.
+      attr_accessor :schedule
+
       # Where this response will be sent to
-      attr_accessor :address
+      attr_reader :address
 
       # Optional callback to be called if the number of retries is exceeded
       attr_accessor :failure_callback
@@ -92,9 +244,29 @@ module Radish
       # Set to true to enable debugging on the response
       attr_accessor :debug
 
+      # The Link this response is going out over
+      attr_reader :link
+
+      # The most packets we'll have in flight at once. It grows by one for
+      # every window's worth of packets that get through, and halves when
+      # one doesn't, like TCP's congestion window.
+      attr_reader :window
+
+      # Smallest and largest the window got, and how many packets had to be
+      # resent.
+      attr_reader :min_window, :max_window, :resent
+
+      # Packets sent so far, counting resends.
+      attr_reader :sent_packets
+
+      # When the request this is a response to came in.
+      attr_accessor :received_at
+
       def initialize(phase_data, sleep_time)
         @phase_data = phase_data
         @sleep_time = sleep_time
+        @clock = 1.0
+        @schedule = nil
         @raw = false
         @retries = 0
         @preempt = false
@@ -110,6 +282,44 @@ module Radish
         # Handler queue is the queue of packets that are "in-flight." (It's
         # actually a queue of their ack-handling procs, thus the name.)
         @handler_queue = []
+        @link = nil
+        self.window = Link::DEFAULT_WINDOW
+        @resent = 0
+        @sent_packets = 0
+        @received_at = Time.now
+      end
+
+      # The radish resets if it hasn't seen the first packet by this time.
+      def deadline
+        @received_at + WATCHDOG_WINDOW
+      end
+
+      # Whether any packets have gone out yet.
+      def started?
+        @sent_packets > 0
+      end
+
+      # How many packets are left to get through.
+      def remaining
+        return @phase > 0 ? 0 : @phase_data[0].length - @packet if @raw
+        @num_packets - @confirmed_seq_num
+      end
+
+      def address=(address)
+        @address = address
+        @destination = [address].pack('H16')
+      end
+
+      def link=(link)
+        @link = link
+        self.window = link.initial_window
+        @min_window = @max_window = @window
+      end
+
+      def window=(window)
+        @window = window
+        @min_window = [@min_window || window, window].min
+        @max_window = [@max_window || window, window].max
       end
 
       def length
@@ -136,6 +346,10 @@ module Radish
           return true
         end
 
+        if @handler_queue.length >= @window.to_i
+          return false
+        end
+
         return @phase < @phase_data.length
       end
 
@@ -192,10 +406,16 @@ module Radish
 
           @confirmed_seq_num += 1
           @handler_queue.shift
+          limit = @link ? @link.limit : Link::MAX_WINDOW
+          self.window = [@window + 1.0 / @window, limit].min
+          @link.window = @window if @link and done?
         else  # The radish didn't get this packet, at least AFAICT.
+          @resent += @handler_queue.length
           @phase = this_phase
           @packet = this_packet
           @retries -= 1
+          self.window = [@window / 2, 1.0].max
+          @link.window = @window if @link
           # Seal all entrances and exits! Close all shops in the mall!
           # Cancel the three-ring circus!
           @handler_queue.each { |x| x.call(-1) }
@@ -203,13 +423,15 @@ module Radish
         end
       end
 
-      # Returns a pair of [data, callback]. The data is the next packet to send,
-      # and the callback is called to return status of whether the packet was
-      # sent successfully.
-      def next
+      # Returns a pair of [frame, callback]. The frame is the next packet to
+      # send, as a TRANSMIT_REQUEST with the given frame ID, and the callback
+      # is called to return status of whether the packet was sent
+      # successfully.
+      def next(frame_id)
         if !packet_ready?
           return nil
         end
+        @sent_packets += 1
 
         if @raw
           p = @phase_data[@phase][@packet]
@@ -225,7 +447,7 @@ module Radish
             end
           end
 
-          return p, proc {}
+          return Frame.new(p).build(frame_id, @destination), proc {}
         end
 
         this_phase = @phase
@@ -239,11 +461,12 @@ module Radish
           @packet = 0
         end
 
-        header = Ascii::STX
         if @phase >= @phase_data.length
           # Tack on the sleep info. There better be room.
-          p = p + sleep_bytes
-          header = Ascii::ETX
+          p = p.payload if p.is_a? Frame
+          p = Frame.new(p + sleep_bytes + (@schedule || ''), Ascii::ETX)
+        elsif !p.is_a? Frame
+          p = Frame.new(p, Ascii::STX)
         end
 
         if @debug
@@ -262,7 +485,7 @@ module Radish
         }
 
         @handler_queue << ack_handler
-        return [header.bytes.first, seq_byte, p].pack('CCa*'), ack_handler
+        return p.build(frame_id, @destination, seq_byte), ack_handler
       end
 
       # Takes a sleep time in seconds and converts it to a ghetto-point
@@ -272,25 +495,36 @@ module Radish
         # to sleep. The second byte is an exponent for the delay. The exponent
         # has five added to it, i.e. the prescaler ranges from 2^5 when exponent
         # is 0 to (max) 2^23 when it's 18.
+        return sleep_count.pack('CC')
+      end  # sleep_bytes
 
-        # Convert to "ticks" of the minimum timeslice - 32 / 31kHz
-        ticks = @sleep_time * (31000.0 / 32)
-        exponent = 0
-
-        # 256 is the next representable tick (at a higher exponent), so the
-        # rounding point is 255.5
-        while (exponent <= 18 and ticks >= 255.5)
-          ticks /= 2.0
-          exponent += 1
-        end
+      # How long the radish will sleep after this response, counted at 31kHz.
+      # That's what sleep_time comes out as after rounding to what the
+      # radish can do, and correcting for its clock.
+      def nominal_sleep
+        count, exponent = sleep_count
+        count * 2**exponent * (32 / 31000.0)
+      end
 
-        ticks = ticks.round
-        if ticks > 255
-          ticks = 255
-        end
+      private
 
-        return [ticks, exponent].pack('CC')
-      end  # sleep_bytes
+      # The [count, exponent] pair for sleep_bytes that comes closest to
+      # sleep_time on this radish's clock.
+      def sleep_count
+        # Convert to "ticks" of the minimum timeslice - 32 / 31kHz
+        ticks = @sleep_time * (31000.0 * @clock / 32)
+
+        # Lower exponents are finer, but a higher one sometimes rounds
+        # better, so try them all. Ties go to the finer one.
+        best = nil
+        for exponent in 0..18
+          count = (ticks / 2**exponent).round
+          count = 255 if count > 255
+          error = (count * 2**exponent - ticks).abs
+          best = [count, exponent, error] if best.nil? or error < best[2]
+        end
+        best[0, 2]
+      end
     end  # Response
 
     @packet_classes = {}
@@ -305,11 +539,7 @@ module Radish
 
     # Class functions
     def self.checksum(data)
-      sum = 0
-      data.each_byte do |i|
-        sum += i
-      end
-      return 0xFF - (sum & 0xFF)
+      return 0xFF - data.sum(8)
     end
 
     def self.parse_data(data)
@@ -334,16 +564,60 @@ module Radish
       p
     end
 
+    # Responses with no more than this many packets left jump ahead of
+    # longer ones that haven't started yet.
+    SHORT_RESPONSE = 1
+
+    # A frame ID whose TRANSMIT_STATUS hasn't shown up after this many
+    # seconds is given up on and reused.
+    FRAME_TIMEOUT = 5
+
     attr_accessor :debug
 
-    def initialize(connection)
+    # Framing errors seen on the serial line, by kind. See FrameDecoder.
+    def framing_errors
+      @decoder.errors
+    end
+
+    # escaped says whether the XBee is in escaped API mode (AP=2).
+    def initialize(connection, escaped = false)
       @connection = connection
+      @escaped = escaped
+      @decoder = FrameDecoder.new(escaped)
+      @framing_errors = @decoder.errors.dup
       @debug = false
       @response_queue = ThreadedQueue.new(&method(:writer_func))
       @writer_queue = []
       @writer_running = false
       @callbacks = [nil] * 256
+      # [link, time] for each frame ID, for measuring status latency
+      @sent = [nil] * 256
       @seq_num = 1
+      @links = Hash.new { |h,k| h[k] = Link.new }
+      @last_served = nil
+    end
+
+    # Returns the Link for a radish's address.
+    def link(address)
+      @links[address]
+    end
+
+    # The Links for every radish we've heard from, keyed by address.
+    def links
+      @links.dup
+    end
+
+    # Responses waiting for the writer thread, or part way through being
+    # sent.
+    def queue_depth
+      @writer_queue.count { |response| !response.done? } +
+        @response_queue.length
+    end
+
+    # Frame IDs waiting on a TRANSMIT_STATUS. When they're all taken, nothing
+    # more goes out.
+    def frame_ids_in_use
+      @callbacks.compact.length
     end
 
     def writer_func
@@ -356,26 +630,22 @@ module Radish
         # Cleanup old responses
         @writer_queue.delete_if {|resp| resp.done?}
 
-        if @debug.is_a?(Fixnum) and @debug > 1
+        if @debug.is_a?(Integer) and @debug > 1
           puts @writer_queue.inspect
           STDOUT.flush
         end
 
-        while !@response_queue.empty?
-          item = @response_queue.slice!(0)
+        while (item = @response_queue.shift)
           if item.is_a? StatusPacket
-            callback = @callbacks[item.frame_id]
-            if !callback
+            if !@callbacks[item.frame_id]
               puts "Recieved status for frame #{item.frame_id}, " +
                    "but we don't remember that packet!"
               STDOUT.flush
-            else
-              if @debug
-                puts "Updating status for frame #{item.frame_id}"
-                STDOUT.flush
-              end
-              callback.call(item.status)
+            elsif @debug
+              puts "Updating status for frame #{item.frame_id}"
+              STDOUT.flush
             end
+            frame_done item.frame_id, item.status
           else
             if item.preempt
               @writer_queue.insert(0, item)
@@ -386,17 +656,18 @@ module Radish
         end  # while
 
         packet = nil
-        for response in @writer_queue
-          next unless response.packet_ready?
-          packet, callback = response.next
-
-          @callbacks[@seq_num] = callback
-          send_packet(
-            [TRANSMIT_REQUEST, @seq_num,
-            response.address, 0x00, packet].pack('CCH16Ca*')
-          )
-          @seq_num = (@seq_num % 255) + 1
-          break
+        response = next_response
+        frame_id = response && allocate_frame_id
+        if frame_id
+          packet, callback = response.next(frame_id)
+          @last_served = response
+
+          @callbacks[frame_id] = callback
+          @sent[frame_id] = [response.link, Time.now]
+          send_packet packet
+        elsif response and @debug
+          puts 'Out of frame IDs, waiting for status'
+          STDOUT.flush
         end
 
         if !packet
@@ -409,9 +680,65 @@ module Radish
       end  # loop
     end  # writer_func
 
-    def send_packet(data)
-      packet = [START_BYTE, data.length, data, Api.checksum(data)].pack('Cna*C')
+    # Picks the response to send the next packet from. Radishes waiting on
+    # their first packet are about to be reset by their watchdog, so they go
+    # first, soonest deadline first, with short responses like cancels ahead
+    # of everything. Transfers that are under way take turns.
+    def next_response
+      ready = @writer_queue.select { |response| response.packet_ready? }
+      return nil if ready.empty?
+
+      waiting = ready.select { |response| !response.started? }
+      if !waiting.empty?
+        return waiting.min_by { |response|
+          [response.preempt ? 0 : 1,
+           response.remaining <= SHORT_RESPONSE ? 0 : 1,
+           response.deadline]
+        }
+      end
+
+      # Round robin, starting after whoever went last.
+      start = (@writer_queue.index(@last_served) || -1) + 1
+      queue = @writer_queue[start..-1] + @writer_queue[0...start]
+      queue.find { |response| ready.include? response }
+    end
+
+    # Frame IDs are shared by every radish: there are only 255 of them, and
+    # each stays taken until its TRANSMIT_STATUS comes back. Returns nil if
+    # they're all in use.
+    def allocate_frame_id
+      255.times do
+        id = @seq_num
+        @seq_num = (@seq_num % 255) + 1
+        sent = @sent[id]
+        if @callbacks[id].nil? or sent.nil?
+          return id
+        elsif Time.now - sent[1] > FRAME_TIMEOUT
+          # Whoever's waiting on the old frame hears that it failed, as if
+          # the XBee had said so, before the ID goes to someone else.
+          frame_done id, 1
+          return id
+        end
+      end
+      nil
+    end
+
+    # Passes a frame's status to its callback, and frees up its ID.
+    def frame_done(frame_id, status)
+      callback = @callbacks[frame_id]
+      if callback
+        link, sent_at = @sent[frame_id]
+        link.status(Time.now - sent_at, status == 0) if link
+        callback.call(status)
+      end
+      # The XBee is done with this frame ID.
+      @callbacks[frame_id] = nil
+      @sent[frame_id] = nil
+    end
 
+    # Writes a frame built by Frame#build.
+    def send_packet(packet)
+      packet = FrameDecoder.escape(packet) if @escaped
       if @debug
         puts 'Sending data: ' + packet.inspect
         STDOUT.flush
@@ -419,34 +746,24 @@ module Radish
       @connection.write packet
     end
 
+    # Reads whatever the XBee has sent, and returns the first packet in it.
+    # Anything else that came in with it is kept for next time.
     def read_api_packet
-      packet = nil
-      while !packet
-        start = @connection.read(1).bytes.first
-
-        if start != START_BYTE
-          puts "Expected #{START_BYTE}, got junk byte " +
-               "#{start.inspect} from wongle"
-          STDOUT.flush
-          next
+      loop do
+        while (data = @decoder.next_frame)
+          packet = Api.parse_data(data)
+          return packet if packet
         end
 
-        length = @connection.read(2).unpack('n')[0]
-
-        data = @connection.read(length)
-        check = @connection.read(1).bytes.first
-
-        if Api.checksum(data) != check
-          puts "Checksum calculated as #{Api.checksum(data)}, but " +
-               "should have been #{check}! Packet: #{data.inspect}"
+        if @decoder.errors != @framing_errors
+          puts "Framing errors from wongle: " +
+               @decoder.errors.map { |kind, n| "#{kind} #{n}" }.join(', ')
           STDOUT.flush
-          next
+          @framing_errors = @decoder.errors.dup
         end
 
-        packet = Api.parse_data(data)
+        @decoder << @connection.read_available
       end
-
-      return packet
     end
 
     # never ending loop to service requests from the radio
@@ -456,10 +773,13 @@ module Radish
     def dispatch_loop
       loop do
         packet = read_api_packet
+        received_at = Time.now
         if packet.is_a? RxPacket
           response = yield packet
           if !response.nil?
             response.address = packet.address
+            response.link = link(packet.address)
+            response.received_at = received_at
             @response_queue << response
           end
         elsif packet.is_a? StatusPacket
@@ -0,0 +1,77 @@
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require 'thread.rb'
+
+module Radish
+  # A record of everything that went over the serial line to the wongle's
+  # XBee, for replay.rb to play back. Every write is one API frame; reads
+  # are whatever the XBee had sent at the time, and get split into frames
+  # on the way back in.
+  #
+  # The file starts with MAGIC, followed by a record for each read and
+  # write: the direction ('r' or 'w'), seconds and microseconds since the
+  # capture started, and the length of the data, then the data.
+  class Capture
+    MAGIC = "RADCAP1\n"
+    RECORD = 'aNNN'
+    RECORD_LENGTH = 13
+
+    # Seconds on a clock that doesn't jump when the wall clock is set.
+    def self.now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    rescue NameError
+      Time.now.to_f
+    end
+
+    # Yields |time, direction, data| for every record in a capture file.
+    def self.each(file)
+      File.open(file, 'rb') do |f|
+        raise "#{file} isn't a capture" if f.read(MAGIC.length) != MAGIC
+        while (record = f.read(RECORD_LENGTH))
+          break if record.length < RECORD_LENGTH
+          direction, sec, usec, length = record.unpack(RECORD)
+          data = f.read(length)
+          # The last record may be cut short if we were killed.
+          break if data.nil? or data.length < length
+          yield sec + usec / 1e6, direction, data
+        end
+      end
+    end
+
+    def initialize(file)
+      @file = File.open(file, 'wb')
+      @file.write MAGIC
+      @file.flush
+      @start = Capture.now
+      # Reads and writes come from different threads.
+      @lock = Mutex.new
+    end
+
+    def record(direction, data)
+      elapsed = Capture.now - @start
+      sec = elapsed.floor
+      @lock.synchronize do
+        @file.write [direction, sec, ((elapsed - sec) * 1e6).round,
+                     data.length].pack(RECORD) + data
+        @file.flush
+      end
+    end
+
+    def close
+      @lock.synchronize { @file.close }
+    end
+  end
+end
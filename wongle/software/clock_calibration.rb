@@ -0,0 +1,104 @@
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+module Radish
+  # Learns how fast each radish's watchdog clock really runs. The radish
+  # sleeps for a number of ticks of a nominally 31kHz clock, which can be
+  # 20% out either way, so we compare how long we asked it to sleep with
+  # how long it was until its next hello.
+  #
+  # Only cancelled wakeups are used. After a screen update the radish
+  # spends a while refreshing the display before it goes to sleep, and we
+  # can't see how long.
+  class ClockCalibration
+    # A radish's clock rate, relative to nominal, before we know better.
+    DEFAULT_RATE = 1.0
+
+    # Sleeps shorter than this are mostly the radish waking up and getting
+    # its hello out, so they aren't worth learning from.
+    MIN_SLEEP = 60
+
+    # Anything further out than this is something other than drift, like a
+    # lost hello.
+    MAX_ERROR = 1.3
+
+    # Once we know a radish's rate, a sleep can run this much longer than
+    # the rate predicts, for temperature and the like. Any longer and the
+    # radish woke up and went back to sleep without a word in between: it
+    # missed our CAN, or was too low on power for the radio, and the
+    # firmware sleeps 1200 seconds then.
+    MAX_DRIFT = 1.1
+
+    # Weight of a new sample in the average.
+    GAIN = 0.2
+
+    def initialize
+      # keyed by remote radio address, value is the rate
+      @rates = {}
+      # keyed by remote radio address, value is [nominal seconds, when the
+      # radish went to sleep]
+      @expected = {}
+    end
+
+    # How fast a radish's clock runs: 1.1 means it ticks 10% faster than
+    # 31kHz, so its sleeps come out short.
+    def rate(radio)
+      @rates[radio] || DEFAULT_RATE
+    end
+
+    # Records that a radish was just told to sleep for nominal seconds,
+    # counted at 31kHz, or that we can't tell how long it'll sleep if
+    # nominal is nil.
+    def expect(radio, nominal, now = Time.now)
+      if nominal
+        @expected[radio] = [nominal, now]
+      else
+        @expected.delete radio
+      end
+    end
+
+    # How long, counted at 31kHz, a radish was last told to sleep, or nil if
+    # we don't know.
+    def expected(radio)
+      expected = @expected[radio]
+      expected && expected[0]
+    end
+
+    # Records a hello. Anything that woke the radish early, like a button
+    # press or a reset, shows up in buttons, and then the sample is no use.
+    # Returns the measured rate, or nil if there wasn't one.
+    def wakeup(radio, buttons, now = Time.now)
+      nominal, slept = @expected.delete radio
+      return nil if nominal.nil? or buttons != 0 or nominal < MIN_SLEEP
+      actual = now - slept
+      return nil if actual <= 0
+      measured = nominal / actual
+      return nil if measured > MAX_ERROR or measured < 1 / MAX_ERROR
+      old = @rates[radio]
+      return nil if old and measured < old / MAX_DRIFT
+      @rates[radio] = old ? old + (measured - old) * GAIN : measured
+      measured
+    end
+
+    # What to keep in the session store. See SessionStore::FIELDS.
+    def state(radio)
+      {'clock' => @rates[radio]}
+    end
+
+    def restore(radio, state)
+      @rates[radio] = state['clock'] if state['clock']
+    end
+  end
+end
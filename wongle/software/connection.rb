@@ -13,6 +13,8 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+require 'capture'
+
 module Radish
   class Connection
     DEFAULT_BPS  = 57600
@@ -22,6 +24,9 @@ module Radish
     attr_accessor :fh
     attr_accessor :tty
 
+    # Capture that everything read and written goes to, or nil.
+    attr_accessor :capture
+
     # finds the first usb serial device attached to the system
     def self.default_port
       ports = Dir.glob "/dev/ttyUSB*" # Linux
@@ -56,9 +61,18 @@ module Radish
     end
 
     def write(*args)
+      capture.record 'w', args.join if capture
       fh.write(*args)
     end
 
+    # Waits for input, then returns whatever has arrived, up to length
+    # bytes. Bypasses fh's buffering, so don't mix it with read.
+    def read_available(length = 4096)
+      data = fh.sysread(length)
+      capture.record 'r', data if capture
+      data
+    end
+
     # Differs slightly from normal read: This guarantees that all bytes are
     # read.
     def read(length)
@@ -68,6 +82,7 @@ module Radish
         raise EOFError if result.nil?
         data << result
       end
+      capture.record 'r', data if capture
       data
     end
 
@@ -13,10 +13,31 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+require 'socket'
+
 module Radish
   class Daemon
 
     BASEDIR = "/var/cache/radish/" # must end in /
+    # longest message one daemon sends another
+    MAX_MESSAGE = 1024
+
+    # Where the daemons keep their state, images, logs and sockets.
+    # Normally BASEDIR, but tools that run a server of their own, like
+    # load_test.rb, point it somewhere else so they leave the real one
+    # alone. Must end in /.
+    def self.basedir
+      @@basedir
+    end
+
+    def self.basedir=(dir)
+      @@basedir = dir.end_with?('/') ? dir : dir + '/'
+    end
+    @@basedir = BASEDIR
+
+    def basedir
+      Daemon.basedir
+    end
 
     attr_accessor :logfile
     attr_accessor :verbose
@@ -30,12 +51,12 @@ module Radish
     end
 
     def default_logfile
-      "%s%s.log" % [ BASEDIR, self.class.to_s.sub(/.*::/,'') ]
+      "%s%s.log" % [ basedir, self.class.to_s.sub(/.*::/,'') ]
     end
 
     # filename to store the pid of this daemon after fork
     def pidfile(runclass = self.class)
-      "%s%s.pid" % [ BASEDIR, runclass.to_s.sub(/.*::/,'') ]
+      "%s%s.pid" % [ basedir, runclass.to_s.sub(/.*::/,'') ]
     end
 
     def writepid
@@ -48,6 +69,33 @@ module Radish
       File.read(pidfile(runclass)).to_i rescue nil
     end
 
+    # Unix datagram socket the daemons use to tell each other about changes
+    def socket_path(runclass = self.class)
+      "%s%s.sock" % [ basedir, runclass.to_s.sub(/.*::/,'') ]
+    end
+
+    # starts a thread that yields each message sent to this daemon
+    def listen
+      File.unlink socket_path rescue nil
+      socket = Socket.new Socket::AF_UNIX, Socket::SOCK_DGRAM, 0
+      socket.bind Socket.pack_sockaddr_un(socket_path)
+      Thread.new do
+        loop do
+          yield socket.recv(MAX_MESSAGE)
+        end
+      end
+    end
+
+    # sends a message to another daemon
+    # returns false if it isn't listening
+    def send_message(runclass, message)
+      @outbox ||= Socket.new Socket::AF_UNIX, Socket::SOCK_DGRAM, 0
+      @outbox.send message, 0, Socket.pack_sockaddr_un(socket_path(runclass))
+      true
+    rescue SystemCallError
+      false
+    end
+
     # returns true if a given process id (pid) hasn't died
     def still_running?(pid)
       Process.kill 0, pid rescue false
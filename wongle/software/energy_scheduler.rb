@@ -0,0 +1,225 @@
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+module Radish
+  # Decides how long each radish sleeps, from what its capacitor has been
+  # doing. Every hello carries the capacitor voltage, so the change since
+  # the last hello, plus what we think the last wakeup cost, is how much
+  # the solar cell put in. That's kept as an average charge rate for each
+  # hour of the day, since most signs see the same light at the same time
+  # every day.
+  #
+  # A radish is then woken as soon as it's expected to have enough charge
+  # for a full screen update and a bit to spare, so signs in sunny rooms
+  # update often and signs in dim corridors don't brown out.
+  class EnergyScheduler
+    # Sleep time for a radish we don't know anything about yet.
+    DEFAULT_SLEEP = 1200
+
+    # No radish is woken more often or less often than this.
+    MIN_SLEEP = 120
+    MAX_SLEEP = 4 * 3600
+
+    # Rough voltage drops. A wakeup that gets cancelled costs the radio
+    # being on for a moment; a full screen update is dominated by the radio
+    # being on for a couple of seconds and then the refresh. The charge rate
+    # estimate soaks up whatever these get wrong.
+    CHECK_COST = 0.01
+    SEND_COST = 0.12
+
+    # Each screen's worth past the first, for radishes that keep pages to
+    # flip through. It's only the radio: there's still one refresh.
+    PAGE_COST = 0.06
+
+    # A refresh on its own, which is what each page flip costs: what's left
+    # of SEND_COST without the radio.
+    REFRESH_COST = SEND_COST - PAGE_COST
+
+    # The most a radish can report: what an ADC reading of 255 comes to.
+    FULL_VOLTS = 3.02
+
+    # No solar cell fills a radish's capacitor, or leak empties it, faster
+    # than this many volts a second. A faster rate is noise in the samples,
+    # usually two hellos close together, and gets cut down to this.
+    MAX_RATE = 0.002
+
+    # How far above the brownout voltage a radish should be left after a
+    # full screen update.
+    MARGIN = 0.1
+
+    # Weight of a new sample in the hourly charge rate averages.
+    GAIN = 0.3
+
+    # Samples further apart than this say nothing about any one hour.
+    MAX_GAP = 6 * 3600
+
+    # Samples kept per radish.
+    HISTORY = 48
+
+    # The time step used when predicting the voltage.
+    STEP = 60
+
+    # About what a transfer of this many bytes costs.
+    def self.send_cost(bytes)
+      screens = bytes / 9600.0
+      CHECK_COST + SEND_COST * [screens, 1.0].min +
+        PAGE_COST * [screens - 1, 0].max
+    end
+
+    def initialize
+      # keyed by remote radio address
+      @radishes = Hash.new do |h,k|
+        h[k] = {'charge' => Array.new(24), 'history' => []}
+      end
+    end
+
+    # A radish's recent voltage and temperature samples, oldest first, as
+    # [time, volts, temp].
+    def history(radio)
+      @radishes[radio]['history']
+    end
+
+    # Records the voltage a radish reported in its hello. Returns the
+    # voltage we predicted it would have, or nil if we didn't.
+    def sample(radio, volts, temp, now = Time.now)
+      radish = @radishes[radio]
+      last = radish['sampled']
+      if last and now > last and now - last < MAX_GAP
+        charged = volts - radish['volts'] + (radish['spent'] || 0)
+        rate = charged / (now - last)
+        rate = bound(rate)
+        # Every hour the sleep touched gets the same rate. Long sleeps
+        # smear dawn and dusk a bit, but short ones sort that out.
+        for hour in hours(last, now)
+          old = radish['charge'][hour]
+          radish['charge'][hour] = old ? old + (rate - old) * GAIN : rate
+        end
+      end
+      history = radish['history']
+      history << [now, volts, temp]
+      history.shift while history.length > HISTORY
+      predicted = radish['predicted']
+      radish['volts'] = volts
+      radish['sampled'] = now
+      radish['predicted'] = radish['spent'] = nil
+      predicted
+    end
+
+    # Seconds a radish should sleep after this wakeup, which costs it about
+    # cost volts. floor is the voltage it browns out at. If there's nothing
+    # to wake up for until some time, wanted is how long that is, and the
+    # radish sleeps at least that long. If it flips pages while it sleeps,
+    # flip is the seconds between flips, each of which costs a refresh.
+    def sleep_time(radio, floor, cost, wanted = nil, flip = nil,
+                   now = Time.now)
+      radish = @radishes[radio]
+      wanted = [[wanted || 0, MIN_SLEEP].max, MAX_SLEEP].min
+      drain = flip ? REFRESH_COST / flip : 0
+      if radish['volts'].nil? or worst_rate(radish).nil?
+        seconds = [DEFAULT_SLEEP, wanted].max
+        radish['spent'] = cost + drain * seconds
+        return seconds
+      end
+
+      volts = radish['volts'] - cost
+      want = floor + MARGIN + SEND_COST
+      seconds = 0
+      while seconds < MAX_SLEEP
+        volts += (rate(radish, now + seconds) - drain) * STEP
+        volts = [[volts, 0.0].max, FULL_VOLTS].min
+        seconds += STEP
+        break if seconds >= wanted and volts >= want
+      end
+      radish['spent'] = cost + drain * seconds
+      radish['predicted'] = volts
+      seconds
+    end
+
+    # What to keep in the session store. See SessionStore::FIELDS.
+    def state(radio)
+      radish = @radishes[radio]
+      {'charge' => radish['charge'], 'volts' => radish['volts'],
+       'sampled' => radish['sampled'], 'spent' => radish['spent'],
+       'predicted' => radish['predicted']}
+    end
+
+    def restore(radio, state)
+      radish = @radishes[radio]
+      if state['charge']
+        radish['charge'] = (state['charge'] + Array.new(24))[0, 24].map do |r|
+          r && bound(r)
+        end
+      end
+      for key in ['volts', 'sampled', 'spent', 'predicted']
+        radish[key] = state[key] if state[key]
+      end
+    end
+
+    private
+
+    # The expected charge rate, in volts per second, at the given time. For
+    # an hour we know nothing about, assume the worst we've seen.
+    def rate(radish, time)
+      radish['charge'][time.hour] || worst_rate(radish)
+    end
+
+    def worst_rate(radish)
+      radish['charge'].compact.min
+    end
+
+    def bound(rate)
+      [[rate, -MAX_RATE].max, MAX_RATE].min
+    end
+
+    # The hours of the day between two times.
+    def hours(from, to)
+      hours = []
+      time = from
+      while time < to and hours.length < 24
+        hours << time.hour
+        time += 3600 - time.min * 60 - time.sec
+      end
+      hours
+    end
+  end
+end
+
+if __FILE__ == $0
+  # Checks that predictions stay within what a radish can report, for one
+  # whose capacitor charges slowly while its hellos come in noisy and at
+  # odd intervals.
+  srand 1
+  scheduler = Radish::EnergyScheduler.new
+  full = Radish::EnergyScheduler::FULL_VOLTS
+  start = now = Time.local(2009, 6, 1, 6)
+  bad = []
+  300.times do
+    volts = [1.5 + 0.0001 * (now - start), full].min
+    reported = [[volts + (rand - 0.5) * 0.2, 0].max, full].min
+    predicted = scheduler.sample('radish', reported, 100, now)
+    if predicted and (predicted < 0 or predicted > full)
+      bad << "predicted #{predicted} V at #{now}"
+    end
+    seconds = scheduler.sleep_time('radish', 1.4, 0.13, nil, nil, now)
+    if seconds < Radish::EnergyScheduler::MIN_SLEEP or
+       seconds > Radish::EnergyScheduler::MAX_SLEEP
+      bad << "slept #{seconds} s at #{now}"
+    end
+    # Now and then a hello comes right after the last, as after a reset.
+    now += rand < 0.2 ? 5 + rand(20) : seconds
+  end
+  puts bad.empty? ? 'ok' : bad
+  exit bad.empty?
+end
@@ -0,0 +1,130 @@
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+module Radish
+  # Cuts the byte stream coming from the XBee into API frames. Bytes go in
+  # with << in whatever chunks they were read, and next_frame hands back
+  # each complete frame's data in turn. Whatever doesn't make up a good frame
+  # is thrown away and counted in errors.
+  #
+  # In escaped mode (AP=2) the XBee never sends a start byte inside a frame,
+  # so a start byte always means a new frame, and a broken frame can't eat
+  # the one after it.
+  class FrameDecoder
+    START_BYTE = 0x7E
+    ESCAPE = 0x7D
+    # Bytes the XBee escapes in AP=2 mode
+    ESCAPED = /[\x7E\x7D\x11\x13]/n
+    # Longer than any frame an XBee sends, so a length this big means we've
+    # lost sync.
+    MAX_LENGTH = 256
+
+    # Framing error counts, keyed by:
+    #   'junk' - bytes thrown away looking for a start byte
+    #   'bad_length' - frames with an impossible length
+    #   'bad_checksum' - frames that didn't add up
+    #   'truncated' - frames cut short by the start of the next one
+    attr_reader :errors
+
+    # Good frames decoded
+    attr_reader :frames
+
+    def initialize(escaped = false)
+      @escaped = escaped
+      @buffer = ''
+      @frames = 0
+      @errors = {'junk' => 0, 'bad_length' => 0, 'bad_checksum' => 0,
+                 'truncated' => 0}
+    end
+
+    # Escapes a frame for sending to an XBee in AP=2 mode.
+    def self.escape(frame)
+      frame[0, 1] + frame[1..-1].gsub(ESCAPED) do |c|
+        [ESCAPE, c.unpack('C')[0] ^ 0x20].pack('CC')
+      end
+    end
+
+    def <<(bytes)
+      @buffer << bytes
+      self
+    end
+
+    # Returns the data in the next complete frame, or nil if there isn't one
+    # yet.
+    def next_frame
+      loop do
+        start = @buffer.index(START_BYTE.chr)
+        if start.nil?
+          discard @buffer.length, 'junk'
+          return nil
+        end
+        discard start, 'junk'
+
+        if @escaped
+          # Everything up to the next start byte belongs to this frame.
+          stop = @buffer.index(START_BYTE.chr, 1)
+          body = @buffer[1...(stop || @buffer.length)]
+          # Wait for the byte that goes with a trailing escape.
+          body = body[0...-1] if !stop and body[-1, 1] == ESCAPE.chr
+          body = body.gsub(/\x7D(.)/mn) { ($1.unpack('C')[0] ^ 0x20).chr }
+        else
+          body = @buffer[1..-1]
+        end
+
+        if body.length < 2
+          return nil if !@escaped or !stop
+          discard stop, 'truncated'
+          next
+        end
+        length = body.unpack('n')[0]
+        if length == 0 or length > MAX_LENGTH
+          # Whatever this is, it isn't a frame, so look for the next one.
+          discard 1, 'bad_length'
+          next
+        end
+        if body.length < length + 3
+          return nil if !@escaped or !stop
+          discard stop, 'truncated'
+          next
+        end
+
+        data = body[2, length]
+        if (data.sum(8) + body[length + 2, 1].unpack('C')[0]) & 0xFF != 0xFF
+          discard 1, 'bad_checksum'
+          next
+        end
+
+        if @escaped
+          # Anything between the end of the frame and the next start byte
+          # is junk.
+          @buffer.slice!(0, stop || @buffer.length)
+          @errors['junk'] += body.length - (length + 3)
+        else
+          @buffer.slice!(0, length + 4)
+        end
+        @frames += 1
+        return data
+      end
+    end
+
+    private
+
+    def discard(length, reason)
+      return if length == 0
+      @buffer.slice!(0, length)
+      @errors[reason] += reason == 'junk' ? length : 1
+    end
+  end
+end
@@ -0,0 +1,102 @@
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require 'net/https'
+require 'thread.rb'
+require 'uri'
+
+module Radish
+  # Keeps HTTP connections open between requests, a few per host, so that
+  # fetching a feed doesn't cost a new TCP (and SSL) handshake every time.
+  # Safe to share between threads.
+  class HttpPool
+    # Connections open to any one host at a time. Lots of signs usually
+    # share a render server, so we don't want to hammer it.
+    PER_HOST = 2
+    OPEN_TIMEOUT = 10
+    READ_TIMEOUT = 30
+
+    def initialize(per_host = PER_HOST)
+      @per_host = per_host
+      @lock = Mutex.new
+      @released = ConditionVariable.new
+      # keyed by [scheme, host, port], value is a list of idle Net::HTTPs
+      @idle = Hash.new { |h,k| h[k] = [] }
+      # keyed by [scheme, host, port], value is the number in use
+      @busy = Hash.new(0)
+    end
+
+    # GETs a URI, blocking while all the host's connections are in use.
+    # Returns the Net::HTTPResponse.
+    def get(uri, header = {})
+      key = [uri.scheme, uri.host, uri.port]
+      http = checkout key
+      begin
+        http ||= connect uri
+        begin
+          http.request_get uri.request_uri, header
+        rescue EOFError, Errno::ECONNRESET, Errno::EPIPE
+          # The server hung up on an idle connection, so try a fresh one.
+          http.finish rescue nil
+          http = connect uri
+          http.request_get uri.request_uri, header
+        end
+      rescue Exception
+        http.finish rescue nil if http
+        http = nil
+        raise
+      ensure
+        checkin key, http
+      end
+    end
+
+    private
+
+    def connect(uri)
+      http = Net::HTTP.new uri.host, uri.port
+      if uri.scheme == 'https'
+        http.use_ssl = true # enable SSL/TLS
+        if File.directory? '/etc/ssl/certs'
+          http.ca_path = '/etc/ssl/certs'
+          http.verify_mode = OpenSSL::SSL::VERIFY_PEER
+        end
+      end
+      http.open_timeout = OPEN_TIMEOUT
+      http.read_timeout = READ_TIMEOUT
+      http.start
+    end
+
+    # Returns an idle connection to the host, or nil if the caller should
+    # open a new one.
+    def checkout(key)
+      @lock.synchronize do
+        while @idle[key].empty? and @busy[key] >= @per_host
+          @released.wait @lock
+        end
+        @busy[key] += 1
+        @idle[key].pop
+      end
+    end
+
+    # Gives a connection back, or just the slot if http is nil.
+    def checkin(key, http)
+      @lock.synchronize do
+        @busy[key] -= 1
+        @idle[key] << http if http
+        @released.broadcast
+      end
+    end
+  end
+end
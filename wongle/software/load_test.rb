@@ -0,0 +1,479 @@
+#!/usr/bin/ruby
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Puts a fleet of virtual radishes in front of a radio server, to see how
+# many signs one wongle can keep up with.
+#
+# It stands in for the wongle's XBee on a pseudo-terminal. Each virtual
+# radish wakes up, says hello and takes packets the way do_radio_stuff in
+# the firmware does, down to the watchdog that resets it if the server is
+# too slow. The XBee's TRANSMIT_STATUS comes back after a configurable
+# latency, and a configurable fraction of packets get lost on the way.
+#
+# By default a RadioServer runs in this process, with a generated image for
+# every virtual radish that changes now and then. It keeps its state in a
+# temporary directory, so it can't upset a real radio server running on the
+# same wongle. With --tty, the pty is
+# left at that path for a radio_server.rb run separately, which then needs
+# feedurls and images for the virtual radishes from somewhere else.
+#
+#   ./load_test.rb -n 50 -t 120
+
+$: << File.dirname($0)
+
+require 'fileutils'
+require 'optparse'
+require 'pty'
+require 'tmpdir'
+require 'api'
+require 'frame_decoder'
+require 'packet_cache'
+require 'radio_server'
+
+module Radish
+  class LoadTest < Daemon
+    include Ascii
+
+    # The firmware we pretend to be: revision, and what it can do. See
+    # main.h.
+    REVISION = 29
+    CAPABILITIES = 0x1F
+
+    # The radish resets if the next byte doesn't show up within this long.
+    WATCHDOG = 0.132
+    # After a reset, the firmware sleeps 2^(backoff + 5) * 128 ticks of its
+    # 31kHz clock, starting at INITIAL_BACKOFF and going up to MAX_BACKOFF.
+    INITIAL_BACKOFF = 4
+    MAX_BACKOFF = 11
+    # Time for the radish to take a byte from its XBee: 10 bits at 57600
+    # baud.
+    BYTE_TIME = 10 / 57600.0
+
+    # Virtual radishes get addresses from here up, so they're easy to tell
+    # apart from real ones.
+    FIRST_ADDRESS = 0x0013a2ff00000000
+
+    # Watchdog bits in the hello. See send_hello in main.c.
+    BUTTONS_WATCHDOG = 1 << 5
+
+    # SOH option for a page schedule at the end of the ETX. See main.h.
+    OPT_PAGES = 0x02
+
+    # The firmware won't turn on the radio below this reading of its
+    # capacitor, and sleeps LOW_POWER_SLEEP seconds instead. See main.c.
+    MIN_RADIO_VOLTAGE = 92
+    LOW_POWER_SLEEP = 1201
+
+    # A virtual radish's capacitor tops out here. Its solar cell charges it
+    # by up to MAX_CHARGE volts for every second of the test, and every
+    # wakeup and every packet it takes cost a little. See EnergyScheduler.
+    FULL_VOLTS = 3.0
+    MAX_CHARGE = 0.01
+    WAKE_VOLTS = 0.01
+    PACKET_VOLTS = 0.001
+
+    # Every this many radishes, one shows as many pages as it can. A full
+    # update of those takes more than 256 packets, so sequence numbers wrap.
+    PAGED_EVERY = 3
+
+    # One virtual radish. Everything it does is driven by the LoadTest event
+    # loop, so none of this needs locking.
+    class VirtualRadish
+      include Ascii
+
+      attr_reader :address
+
+      # What happened to each wakeup: 'ack', 'cancel', 'nak' or 'watchdog'.
+      attr_reader :results
+
+      # Seconds from each hello to the first byte of the response.
+      attr_reader :latencies
+
+      # Transfers that came with a schedule for more than one page.
+      attr_reader :paged
+
+      def initialize(test, address, rssi)
+        @test = test
+        @address = address
+        @rssi = rssi
+        @results = Hash.new(0)
+        @latencies = []
+        @paged = 0
+        @buttons = 1 << 7  # power on
+        @backoff = INITIAL_BACKOFF
+        @awake = false
+        @seq = 0
+        @volts = FULL_VOLTS / 2 + rand * FULL_VOLTS / 2
+        @charge = rand * MAX_CHARGE
+        @charged = Time.now
+      end
+
+      def wake
+        charge WAKE_VOLTS
+        power = (@volts / RadioServer::VOLTS_PER_BIT).round
+        if power < MIN_RADIO_VOLTAGE
+          @test.at(Time.now + LOW_POWER_SLEEP * @test.scale) { wake }
+          return
+        end
+        @awake = true
+        # Like the firmware, it says which packet it got last, even if a
+        # watchdog reset cut that wakeup short.
+        last_count = (@seq - 1) & 0xFF
+        @seq = 0
+        @first = true
+        @with_pages = false
+        @said_hello = Time.now
+        @test.receive self, [SYN, REVISION, power, @buttons, last_count, 100,
+                             CAPABILITIES].pack('anCCCCC'), @rssi
+        @buttons = 0
+        watchdog
+      end
+
+      # A packet from the server made it over the air.
+      def deliver(data)
+        return if !@awake
+        if @first
+          @first = false
+          latency = Time.now - @said_hello
+          @latencies << latency
+          # The firmware counts loop iterations of about 6us while it waits.
+          cycles = [[((latency * 1e6 - 12) / 6).to_i, 0].max, 65535].min
+          @test.receive self, [0, cycles].pack('Cn'), @rssi
+        end
+        watchdog(data.length * BYTE_TIME)
+        charge PACKET_VOLTS
+
+        case data[0, 1]
+        when CAN
+          sleep_for 'cancel', data[1, 2]
+        when STX, ETX, SOH
+          seq, length = data[1, 2].unpack('CC')
+          ok = (seq == @seq)
+          @seq = (@seq + 1) & 0xFF if ok
+          if data[0, 1] == SOH and ok and length > 0
+            @with_pages = (data[3, 1].unpack('C')[0] & OPT_PAGES) != 0
+          elsif data[0, 1] == ETX and ok
+            # With RLE_FLAG, the length counts encoded bytes, so the sleep
+            # bytes still come right after them.
+            tail = 3 + (length & 0x7F)
+            pages = @with_pages ? data[tail + 2, 1].unpack('C')[0] : 1
+            @paged += 1 if pages > 1
+            @test.receive self, [ACK, 0, 0].pack('aCC'), @rssi
+            sleep_for 'ack', data[tail, 2]
+          end
+        else
+          @test.receive self, [NAK, @seq - 1, 0, 0].pack('aCCC'), @rssi
+          reset 'nak'
+        end
+      end
+
+      def summary
+        wakeups = @results.values.inject(0) { |sum, n| sum + n }
+        done = @results['ack'] + @results['cancel']
+        [wakeups, done, @latencies, @paged]
+      end
+
+      private
+
+      # Brings the capacitor up to date, less what was just used.
+      def charge(used)
+        now = Time.now
+        @volts = [@volts + (now - @charged) * @charge, FULL_VOLTS].min - used
+        @volts = 0.0 if @volts < 0
+        @charged = now
+      end
+
+      # Resets the watchdog, and has it go off if nothing comes in time.
+      def watchdog(extra = 0)
+        deadline = Time.now + WATCHDOG + extra
+        @deadline = deadline
+        @test.at(deadline) do
+          if @awake and @deadline == deadline
+            @buttons = BUTTONS_WATCHDOG
+            reset 'watchdog'
+          end
+        end
+      end
+
+      # What the firmware does at soft_reset.
+      def reset(why)
+        @results[why] += 1
+        @awake = false
+        seconds = 2**(@backoff + 5) * 128 / 31000.0
+        @backoff = [@backoff + 1, MAX_BACKOFF].min
+        @test.at(Time.now + seconds) { wake }
+      end
+
+      # Goes to sleep for as long as sleep_bytes says.
+      def sleep_for(why, sleep_bytes)
+        @results[why] += 1
+        @awake = false
+        @backoff = INITIAL_BACKOFF
+        count, exponent = sleep_bytes.unpack('CC')
+        seconds = count * 2**(exponent + 5) / 31000.0 * @test.scale
+        @test.at(Time.now + seconds) { wake }
+      end
+    end
+
+    attr_accessor :radishes, :duration, :latency, :loss, :rssi, :scale
+    attr_accessor :change_every, :tty, :seed
+
+    def initialize
+      super
+      @radishes = 10
+      @duration = 60
+      @latency = 0.005
+      @loss = 0.0
+      @rssi = 40
+      @scale = 0.01
+      @change_every = 30
+      @tty = nil
+      @seed = 1
+      # [time, sequence, block], soonest first
+      @events = []
+      @sequence = 0
+      @decoder = FrameDecoder.new
+      @by_address = {}
+      @packets = 0
+      @bytes = 0
+      @lost = 0
+    end
+
+    # Runs the block at the given time.
+    def at(time, &block)
+      event = [time, @sequence += 1, block]
+      index = @events.index { |e| (e[0] <=> time) > 0 } || @events.length
+      @events.insert index, event
+    end
+
+    # Sends the server a RECEIVE_PACKET from a radish.
+    def receive(radish, data, rssi)
+      write_frame [Api::RECEIVE_PACKET, radish.address, rssi,
+                   0].pack('CH16CC') + data
+    end
+
+    def run
+      srand @seed
+      master, slave = PTY.open
+      path = slave.path
+      if @tty
+        File.unlink @tty rescue nil
+        File.symlink path, @tty
+        puts "XBee is at #{@tty}"
+      else
+        # Sessions, images, packets and the server's socket all go here.
+        Daemon.basedir = Dir.mktmpdir('radish-load')
+        start_server path
+      end
+      @master = master
+      @master.binmode
+      STDOUT.flush
+
+      fleet = (0...@radishes).map do |i|
+        address = '%016x' % (FIRST_ADDRESS + i)
+        @by_address[address] = VirtualRadish.new(self, address,
+                                                 @rssi + rand(20))
+      end
+      if !@tty
+        # Planning the packets takes a while, so it can't happen in the
+        # event loop without the radishes' watchdogs going off.
+        change_images fleet
+        Thread.new do
+          loop do
+            sleep @change_every
+            change_images fleet
+          end
+        end
+      end
+      for radish in fleet
+        # Radishes don't all wake at once, even after a power cut.
+        at(Time.now + 1 + rand * 5, &radish.method(:wake))
+      end
+
+      started = Time.now
+      stop = started + @duration
+      while Time.now < stop
+        wait = @events.empty? ? 0.1 : [@events[0][0] - Time.now, 0].max
+        if select([@master], nil, nil, [wait, stop - Time.now].min)
+          @decoder << @master.sysread(4096)
+          while (data = @decoder.next_frame)
+            transmit data
+          end
+        end
+        while !@events.empty? and @events[0][0] <= Time.now
+          @events.shift[2].call
+        end
+      end
+      report fleet, Time.now - started
+    ensure
+      FileUtils.rm_rf Daemon.basedir if !@tty and Daemon.basedir != BASEDIR
+    end
+
+    private
+
+    def write_frame(payload)
+      sum = payload.unpack('C*').inject(0) { |s, c| s + c }
+      @master.write [Api::START_BYTE, payload.length].pack('Cn') + payload +
+        (0xFF - (sum & 0xFF)).chr
+    end
+
+    # Handles a TRANSMIT_REQUEST from the server the way the XBee would:
+    # maybe gets it to the radish, and says whether it did.
+    def transmit(data)
+      id, frame_id, address, payload = data.unpack('CCH16xa*')
+      return if id != Api::TRANSMIT_REQUEST
+      @packets += 1
+      @bytes += payload.length
+      radish = @by_address[address]
+      delivered = (radish and rand >= @loss)
+      @lost += 1 if !delivered
+      # Halfway there the radish has it; the status comes back after.
+      at(Time.now + @latency / 2) { radish.deliver payload } if delivered
+      at(Time.now + @latency) do
+        write_frame [Api::TRANSMIT_STATUS, frame_id, delivered ? 0 : 1,
+                     ].pack('CCC')
+      end
+    end
+
+    # Runs a RadioServer in this process, with images for the fleet.
+    def start_server(path)
+      server = RadioServer.new
+      server.tty = path
+      server.metrics_port = nil
+      server.feedurls = {}
+      for i in 0...@radishes
+        server.feedurls['%016x' % (FIRST_ADDRESS + i)] = 'load test'
+      end
+      server.connect
+      Thread.abort_on_exception = true
+      Thread.new { server.run }
+      # The server flushes the serial line before it starts.
+      sleep 0.5
+    end
+
+    # Gives every radish an image, or a few of them a new one, the way
+    # SignFetcher would.
+    def change_images(fleet)
+      page = 11 + PacketPlanner::PAGE_BYTES
+      fleet.each_with_index do |radish, i|
+        old = File.open(image_file(radish), 'rb') { |f| f.read } rescue nil
+        old = nil if old and (old.length == 0 or old.length % page != 0)
+        if old.nil?
+          pages = i % PAGED_EVERY == 0 ? PacketPlanner::MAX_PAGES : 1
+          pbm = (0...pages).map { "P4\n320 240\n" + random_rows(240) }.join
+        else
+          next if rand > 0.2
+          # A band of rows on one page, like a line of text changing.
+          rows = 1 + rand(60)
+          pbm = old.dup
+          start = rand(old.length / page) * page + 11
+          pbm[start + rand(240 - rows) * 40, rows * 40] = random_rows(rows)
+        end
+        File.open(image_file(radish), 'wb') { |f| f.write pbm }
+        image = PacketCache.precompute(pbm, old)
+        send_message RadioServer, "image #{radish.address} #{image.digest}"
+      end
+    end
+
+    def random_rows(rows)
+      (0...rows * 40).map { rand(256) }.pack('C*')
+    end
+
+    def image_file(radish)
+      basedir + radish.address + '.pbm'
+    end
+
+    def report(fleet, elapsed)
+      puts
+      printf("%-16s %7s %7s %7s %9s %9s\n", 'radish', 'wakeups', 'done',
+             'rate', 'median ms', '99% ms')
+      all = []
+      total = done_total = paged_total = 0
+      for radish in fleet
+        wakeups, done, latencies, paged = radish.summary
+        total += wakeups
+        done_total += done
+        paged_total += paged
+        all.concat latencies
+        printf("%-16s %7d %7d %6.0f%% %9s %9s\n", radish.address, wakeups,
+               done, wakeups > 0 ? 100.0 * done / wakeups : 0,
+               percentile(latencies, 50), percentile(latencies, 99))
+      end
+      puts
+      printf("%d wakeups, %.1f%% completed, first packet median %s ms, " +
+             "99%% %s ms\n", total,
+             total > 0 ? 100.0 * done_total / total : 0,
+             percentile(all, 50), percentile(all, 99))
+      printf("%d transfers with pages\n", paged_total)
+      printf("%.1f packets/s, %.0f bytes/s, %d lost, over %.0f s\n",
+             @packets / elapsed, @bytes / elapsed, @lost, elapsed)
+      STDOUT.flush
+    end
+
+    def percentile(samples, p)
+      return '-' if samples.empty?
+      sorted = samples.sort
+      '%.1f' % (sorted[(sorted.length - 1) * p / 100] * 1000)
+    end
+  end
+end
+
+if __FILE__ == $0
+  test = Radish::LoadTest.new
+  OptionParser.new do |opts|
+    opts.banner = "Usage: #{$0} [options]"
+
+    opts.on("-n", "--radishes N", Integer,
+            "Virtual radishes [default: #{test.radishes}]") { |arg|
+      test.radishes = arg
+    }
+    opts.on("-t", "--time SECONDS", Float,
+            "How long to run [default: #{test.duration}]") { |arg|
+      test.duration = arg
+    }
+    opts.on("--latency MS", Float,
+            "Time for a TRANSMIT_STATUS to come back " +
+            "[default: #{test.latency * 1000}]") { |arg|
+      test.latency = arg / 1000
+    }
+    opts.on("--loss FRACTION", Float,
+            "Fraction of packets lost [default: #{test.loss}]") { |arg|
+      test.loss = arg
+    }
+    opts.on("--rssi DBM", Integer,
+            "Best signal strength, as -dBm; radishes get up to 20 worse " +
+            "[default: #{test.rssi}]") { |arg|
+      test.rssi = arg
+    }
+    opts.on("--scale FACTOR", Float,
+            "Multiplies the sleep times the server asks for " +
+            "[default: #{test.scale}]") { |arg|
+      test.scale = arg
+    }
+    opts.on("--change SECONDS", Float,
+            "How often images change [default: #{test.change_every}]") { |arg|
+      test.change_every = arg
+    }
+    opts.on("--seed N", Integer, "Random seed [default: #{test.seed}]") { |arg|
+      test.seed = arg
+    }
+    opts.on("--tty PATH",
+            "Leave the XBee at PATH for a separate radio server") { |arg|
+      test.tty = arg
+    }
+  end.parse!
+  test.run
+end
@@ -0,0 +1,289 @@
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require 'net/http'
+require 'net/https'
+require 'stringio'
+require 'thread.rb'
+require 'timeout'
+require 'zlib'
+require 'daemon'
+
+module Radish
+  # Sends log entries up to the wangler from a thread of its own. Entries
+  # go up in batches, as gzipped newline-delimited JSON, one object per
+  # entry. A batch goes when it's big enough or its oldest entry has waited
+  # long enough, so a busy wongle makes few requests and a quiet one still
+  # reports promptly.
+  #
+  # While the wangler can't be reached, entries pile up in memory until
+  # there are too many, and then batches get written to the spool, which is
+  # sent first once the wangler is back. The spool is bounded too; past
+  # that the oldest batches are thrown away.
+  #
+  # The block gets every response the wangler sends back.
+  class LogShipper
+    def self.spool
+      Daemon.basedir + 'logspool/' # must end in /
+    end
+
+    # A batch goes up when it has this many entries...
+    BATCH_ENTRIES = 500
+    # ...or its oldest entry has waited this many seconds.
+    BATCH_DELAY = 5
+
+    # Past this many entries in memory, the worker moves batches to the
+    # spool...
+    SPILL_AT = 1000
+    # ...and past this many, which only happens while it's stuck sending,
+    # the oldest are thrown away as new ones come in.
+    MAX_MEMORY = 2000
+
+    # Bytes kept in the spool. Past this, the oldest batches are thrown away.
+    MAX_SPOOL = 16 * 1024 * 1024
+
+    # How long to wait after the wangler fails, doubling each time it fails
+    # again, up to MAX_BACKOFF. A random part of it is taken off, so a
+    # cluster of wongles doesn't hammer the wangler all at once when it
+    # comes back.
+    MIN_BACKOFF = 3
+    MAX_BACKOFF = 300
+
+    attr_reader :uri
+
+    # Number of entries thrown away because memory or the spool was full.
+    attr_reader :dropped
+
+    def initialize(uri, spool = LogShipper.spool, &block)
+      @uri = uri
+      @spool = spool
+      @response_proc = block
+      @entries = []
+      @first = 0     # number of the entry at the front of @entries
+      @oldest = nil  # when the oldest entry in @entries was queued
+      @dropped = 0
+      @failures = 0
+      @mutex = Mutex.new
+      @ready = ConditionVariable.new
+      @worker = nil
+    end
+
+    # Queues an entry. This is called on the radio server's dispatcher, so
+    # it never touches the disk: the worker spills to the spool.
+    def <<(entry)
+      @mutex.synchronize do
+        @oldest ||= Time.now
+        @entries << entry
+        if @entries.length > MAX_MEMORY
+          @entries.shift
+          @first += 1
+          @dropped += 1
+        end
+        @worker ||= Thread.new { work }
+        @ready.signal
+      end
+      self
+    end
+
+    # Entries waiting in memory. Doesn't count what's in the spool.
+    def length
+      @mutex.synchronize { @entries.length }
+    end
+
+    # Turns entries into a gzipped batch, one JSON object per line.
+    def self.encode(entries)
+      out = StringIO.new
+      gz = Zlib::GzipWriter.new(out)
+      for entry in entries
+        gz.write json(entry)
+        gz.write "\n"
+      end
+      gz.close
+      out.string
+    end
+
+    # Just enough JSON for log entries: hashes, arrays, strings, numbers,
+    # true, false and nil. Anything else goes as its to_s.
+    def self.json(value)
+      case value
+      when Hash
+        pairs = value.map { |k, v| json(k.to_s) + ':' + json(v) }
+        '{' + pairs.join(',') + '}'
+      when Array
+        '[' + value.map { |v| json(v) }.join(',') + ']'
+      when Integer
+        value.to_s
+      when Float
+        value.finite? ? value.to_s : 'null'
+      when true, false
+        value.to_s
+      when nil
+        'null'
+      else
+        '"' + value.to_s.gsub(/["\\\x00-\x1f]/) do |c|
+          case c
+          when '"' then '\\"'
+          when '\\' then '\\\\'
+          when "\n" then '\\n'
+          else '\\u%04x' % c.unpack('C')[0]
+          end
+        end + '"'
+      end
+    end
+
+    private
+
+    def work
+      loop do
+        batch = next_batch
+        if post batch[0]
+          @failures = 0
+          if batch[1]
+            File.unlink batch[1] rescue nil
+          else
+            @mutex.synchronize do
+              # Some of them may have been thrown away while we were sending.
+              sent = batch[2] - @first
+              if sent > 0
+                @entries.slice!(0, sent)
+                @first += sent
+              end
+            end
+          end
+        else
+          @failures += 1
+          backoff = [MIN_BACKOFF * 2**(@failures - 1), MAX_BACKOFF].min
+          pause backoff * (0.5 + rand / 2)
+        end
+      end
+    end
+
+    # Sleeps for the given seconds, spilling to the spool whenever too many
+    # entries pile up in memory meanwhile.
+    def pause(seconds)
+      deadline = Time.now + seconds
+      loop do
+        spill_excess
+        left = deadline - Time.now
+        break if left <= 0
+        @mutex.synchronize do
+          @ready.wait(@mutex, left) if @entries.length <= SPILL_AT
+        end
+      end
+    end
+
+    # Waits for something to send, and returns [body, spool file, last]:
+    # the spool file it came from, or else the number of the entry after
+    # the last one in it.
+    def next_batch
+      loop do
+        spill_excess
+        file = spooled.first
+        if file
+          body = File.open(file, 'rb') { |f| f.read } rescue nil
+          return [body, file, nil] if body
+          File.unlink file rescue nil
+          next
+        end
+
+        @mutex.synchronize do
+          @ready.wait(@mutex) while @entries.empty?
+        end
+        # Let a batch fill up, unless it already has.
+        wait = BATCH_DELAY - (Time.now - (@oldest || Time.now))
+        pause wait if wait > 0 and length < BATCH_ENTRIES
+
+        @mutex.synchronize do
+          # It may have been spilled to the spool while we slept.
+          next if @entries.empty?
+          batch = @entries[0, BATCH_ENTRIES]
+          @oldest = @entries.length > batch.length ? Time.now : nil
+          return [LogShipper.encode(batch), nil, @first + batch.length]
+        end
+      end
+    end
+
+    # Sends a batch. Returns whether the wangler took it.
+    def post(body)
+      http = Net::HTTP.new @uri.host, @uri.port
+      http.read_timeout = 20
+      if @uri.scheme == 'https'
+        http.use_ssl = true
+        http.ca_path = '/etc/ssl/certs'
+        http.verify_mode = OpenSSL::SSL::VERIFY_PEER
+      end
+      res = http.request_post @uri.request_uri, body,
+        'Content-Type' => 'application/x-ndjson', 'Content-Encoding' => 'gzip'
+      res.error! unless res.is_a? Net::HTTPSuccess
+      @response_proc.call res if @response_proc
+      true
+    rescue StandardError, Timeout::Error => ex
+      puts "Exception talking to wangler (at %s): %s" % [@uri, ex.inspect]
+      STDOUT.flush
+      false
+    end
+
+    # Spool files, oldest first.
+    def spooled
+      Dir[@spool + '*.ndjson.gz'].sort
+    end
+
+    # Moves the oldest batches in memory to the spool, until there are no
+    # more than SPILL_AT left.
+    def spill_excess
+      loop do
+        batch = @mutex.synchronize do
+          if @entries.length > SPILL_AT
+            @first += BATCH_ENTRIES
+            @entries.slice!(0, BATCH_ENTRIES)
+          end
+        end
+        break if batch.nil?
+        spill batch
+      end
+    end
+
+    # Writes a batch of entries to the spool.
+    def spill(batch)
+      begin
+        Dir.mkdir @spool
+      rescue Errno::EEXIST
+      end
+      name = @spool + '%.6f-%d.ndjson.gz' % [Time.now.to_f, $$]
+      File.open(name + '.tmp', 'wb') { |f| f.write LogShipper.encode(batch) }
+      File.rename name + '.tmp', name
+
+      # Keep the spool bounded.
+      files = spooled
+      sizes = files.map { |f| File.size(f) rescue 0 }
+      total = sizes.inject(0) { |sum, size| sum + size }
+      while total > MAX_SPOOL and files.length > 1
+        file = files.shift
+        entries = begin
+          Zlib::GzipReader.open(file) { |gz| gz.each_line.count }
+        rescue Zlib::Error, SystemCallError
+          0
+        end
+        File.unlink file rescue nil
+        total -= sizes.shift
+        @mutex.synchronize { @dropped += entries }
+      end
+    rescue SystemCallError => e
+      puts "Couldn't spool log entries: #{e.inspect}"
+      STDOUT.flush
+      @mutex.synchronize { @dropped += batch.length }
+    end
+  end
+end
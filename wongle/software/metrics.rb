@@ -0,0 +1,176 @@
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require 'socket'
+require 'thread.rb'
+
+module Radish
+  # Counters, gauges and histograms, served over HTTP in Prometheus' text
+  # format. Every metric has to be described before it's used. Values are
+  # kept per set of labels, so
+  #
+  #   metrics.count 'radish_naks_total', 'mac' => mac, 'failure' => 'overrun'
+  #
+  # keeps a separate count for each radish and kind of failure.
+  #
+  # Things that are cheaper to look at when someone asks than to keep up
+  # to date, like queue lengths, go in a collect block, which runs before
+  # the metrics are served.
+  class Metrics
+    # Where metrics are served by default. Only on localhost: anyone who
+    # wants them from elsewhere can go through ssh.
+    DEFAULT_PORT = 9105
+
+    # A client gets this many seconds to send its request, and can't send
+    # more than MAX_REQUEST bytes of it, so a stuck one can't hold up the
+    # next.
+    REQUEST_TIMEOUT = 5
+    MAX_REQUEST = 8192
+
+    def initialize
+      @lock = Mutex.new
+      # keyed by name, value is [type, help, buckets]
+      @described = {}
+      # keyed by name, value is a hash keyed by labels
+      @values = {}
+      @collectors = []
+    end
+
+    # Describes a metric. type is :counter, :gauge or :histogram, and a
+    # histogram needs the upper bounds of its buckets, in order.
+    def describe(name, type, help, buckets = nil)
+      @lock.synchronize do
+        @described[name] = [type, help, buckets]
+        @values[name] ||= {}
+      end
+      self
+    end
+
+    # Adds n to a counter.
+    def count(name, labels = {}, n = 1)
+      @lock.synchronize do
+        values = @values.fetch(name)
+        values[labels] = (values[labels] || 0) + n
+      end
+    end
+
+    # Sets a gauge. A nil value removes it.
+    def set(name, value, labels = {})
+      @lock.synchronize do
+        if value.nil?
+          @values.fetch(name).delete labels
+        else
+          @values.fetch(name)[labels] = value
+        end
+      end
+    end
+
+    # Adds a sample to a histogram.
+    def observe(name, value, labels = {})
+      @lock.synchronize do
+        buckets = @described.fetch(name)[2]
+        histogram = @values.fetch(name)[labels] ||=
+          [Array.new(buckets.length, 0), 0, 0.0]
+        buckets.each_with_index do |bound, i|
+          histogram[0][i] += 1 if value <= bound
+        end
+        histogram[1] += 1
+        histogram[2] += value
+      end
+    end
+
+    # Runs the block before the metrics are served.
+    def collect(&block)
+      @lock.synchronize { @collectors << block }
+    end
+
+    # Everything, in Prometheus' text format.
+    def render
+      collectors = @lock.synchronize { @collectors.dup }
+      for collector in collectors
+        collector.call self
+      end
+
+      out = []
+      @lock.synchronize do
+        for name in @described.keys.sort
+          type, help, buckets = @described[name]
+          out << "# HELP #{name} #{help}"
+          out << "# TYPE #{name} #{type}"
+          for labels, value in @values[name]
+            if type == :histogram
+              buckets.each_with_index do |bound, i|
+                out << sample(name + '_bucket',
+                              labels.merge('le' => bound.to_s), value[0][i])
+              end
+              out << sample(name + '_bucket', labels.merge('le' => '+Inf'),
+                            value[1])
+              out << sample(name + '_count', labels, value[1])
+              out << sample(name + '_sum', labels, value[2])
+            else
+              out << sample(name, labels, value)
+            end
+          end
+        end
+      end
+      out.join("\n") + "\n"
+    end
+
+    # Starts a thread that serves the metrics over HTTP, whatever the path.
+    def serve(port = DEFAULT_PORT, host = '127.0.0.1')
+      server = TCPServer.new(host, port)
+      Thread.new do
+        loop do
+          client = server.accept
+          begin
+            # Nobody needs anything but the metrics, so the request only
+            # has to be read to the end of its headers.
+            request = ''
+            deadline = Time.now + REQUEST_TIMEOUT
+            until request =~ /\r?\n\r?\n/
+              left = deadline - Time.now
+              if left <= 0 or !IO.select([client], nil, nil, left)
+                raise 'timed out reading request'
+              end
+              request << client.readpartial(1024)
+              raise 'request too long' if request.length > MAX_REQUEST
+            end
+            body = render
+            client.write "HTTP/1.0 200 OK\r\n" +
+              "Content-Type: text/plain; version=0.0.4\r\n" +
+              "Content-Length: #{body.length}\r\n\r\n" + body
+          rescue StandardError => e
+            puts "Couldn't serve metrics: #{e.inspect}"
+            STDOUT.flush
+          ensure
+            client.close rescue nil
+          end
+        end
+      end
+    end
+
+    private
+
+    def sample(name, labels, value)
+      if !labels.empty?
+        name += '{' + labels.keys.sort.map { |k|
+          value_s = labels[k].to_s.gsub(/[\\"]/) { |c| '\\' + c }
+          "#{k}=\"#{value_s.gsub("\n", '\\n')}\""
+        }.join(',') + '}'
+      end
+      "#{name} #{value}"
+    end
+  end
+end
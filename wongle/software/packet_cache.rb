@@ -0,0 +1,281 @@
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require 'digest/sha1'
+require 'thread.rb'
+require 'daemon'
+require 'api'
+require 'packet_planner'
+
+module Radish
+  # Keeps images around already converted and cut up into packets, so that
+  # answering a SYN doesn't mean reading, converting and planning the image
+  # all over again while the radish's watchdog is running. Images are keyed
+  # by a hash of the pbm, so radishes showing the same picture share them.
+  #
+  # SignFetcher plans the packets for a new image as soon as it installs it,
+  # and leaves them in the store, where the radio server picks them up.
+  class PacketCache
+    def self.store
+      Daemon.basedir + 'packets/' # must end in /
+    end
+
+    # Images kept in memory. The least recently used one gets dropped.
+    MAX_IMAGES = 32
+
+    # Plans kept for any one image. Partial updates after a failed transfer
+    # each get a plan of their own, and those rarely come up twice.
+    MAX_PLANS = 8
+
+    # Files in the store that haven't been written in this many seconds get
+    # cleaned up.
+    STORE_MAX_AGE = 7 * 24 * 3600
+
+    # Store files start with this. Anything else in the store is ignored.
+    STORE_MAGIC = "radish packets 1\n"
+
+    # The :rle options a plan can have, numbered as in the store.
+    RLE_OPTIONS = [false, true, :buffered]
+
+    # A raw image and the packets for drawing it.
+    class Image
+      attr_reader :digest, :raw
+
+      # Command packets, keyed by [rle, ranges]
+      attr_reader :plans
+
+      def initialize(digest, raw, plans = {})
+        @digest = digest
+        @raw = raw
+        @plans = plans
+        # keyed by [rle, ranges], value is the plan as Api::Frames
+        @frames = {}
+        # keyed by the digest of another image, value is what differs
+        @deltas = {}
+      end
+
+      # How many screens the image has.
+      def pages
+        @raw.length / PacketPlanner::PAGE_BYTES
+      end
+
+      # The [offset, length] ranges that differ from another Image, or all
+      # of it if old is nil.
+      def dirty_ranges(old)
+        return [[0, @raw.length]] if old.nil?
+        @deltas.clear if @deltas.length >= MAX_IMAGES
+        @deltas[old.digest] ||= PacketPlanner.dirty_ranges(old.raw, @raw)
+      end
+
+      # Command packets that draw the given ranges. rle is the :rle option
+      # for PacketPlanner.
+      def plan(ranges, rle)
+        key = [rle || false, ranges]
+        @plans[key] ||= PacketPlanner.new(@raw, :rle => rle).plan(ranges)
+      end
+
+      # Same as plan, but framed and ready to go out.
+      def packets(ranges, rle)
+        key = [rle || false, ranges]
+        if !@frames[key]
+          @frames.clear if @frames.length >= MAX_PLANS
+          @frames[key] = plan(ranges, rle).map do |command|
+            Api::Frame.new(command, Ascii::STX)
+          end
+        end
+        @frames[key]
+      end
+    end
+
+    # convert pbm format to radish image format
+    # A pbm can hold several images one after another. Each is a page, for
+    # radishes that can flip between them (see PacketPlanner::MAX_PAGES).
+    def self.pbm2raw(pbm)
+      # since pbm is so similar, conversion is easy
+      page = 11 + PacketPlanner::PAGE_BYTES
+      raise 'BadImage' if pbm.length == 0 or pbm.length % page != 0 or
+        pbm.length / page > PacketPlanner::MAX_PAGES
+      (0...pbm.length / page).map { |i|
+        header, *data = pbm[i * page, page].unpack('A11C*')
+        raise 'BadImage' if header != "P4\n320 240\n"
+        data.map! { |v| 255 - v } # invert bits
+        data.pack('C*')
+      }.join
+    end
+
+    # Returns the Image SignFetcher left in the store, or nil if there isn't
+    # a good one.
+    def self.stored(digest)
+      decode(digest, File.open(store + digest, 'rb') { |f| f.read })
+    rescue StandardError
+      nil
+    end
+
+    # An Image and its plans as they go in the store: nothing but lengths
+    # and bytes, since the store is writable by more than the radio server.
+    def self.encode(image)
+      out = [STORE_MAGIC, [image.raw.length].pack('N'), image.raw,
+             [image.plans.length].pack('N')]
+      image.plans.each do |(rle, ranges), commands|
+        out << [RLE_OPTIONS.index(rle), ranges.length].pack('CN')
+        out << ranges.flatten.pack('N*')
+        out << [commands.length].pack('N')
+        for command in commands
+          out << [command.length].pack('n') << command
+        end
+      end
+      out.join
+    end
+
+    # The reverse of encode. Raises 'BadStore' if data isn't one.
+    def self.decode(digest, data)
+      raise 'BadStore' if data[0, STORE_MAGIC.length] != STORE_MAGIC
+      pos = STORE_MAGIC.length
+      take = lambda do |length|
+        raise 'BadStore' if pos + length > data.length
+        pos += length
+        data[pos - length, length]
+      end
+      raw = take.call(take.call(4).unpack('N')[0])
+      raise 'BadStore' if raw.length == 0 or
+        raw.length % PacketPlanner::PAGE_BYTES != 0
+      plans = {}
+      take.call(4).unpack('N')[0].times do
+        rle, count = take.call(5).unpack('CN')
+        raise 'BadStore' if rle >= RLE_OPTIONS.length
+        ranges = take.call(8 * count).unpack('N*').each_slice(2).to_a
+        commands = []
+        take.call(4).unpack('N')[0].times do
+          commands << take.call(take.call(2).unpack('n')[0])
+        end
+        plans[[RLE_OPTIONS[rle], ranges]] = commands
+      end
+      raise 'BadStore' if pos != data.length
+      Image.new(digest, raw, plans)
+    end
+
+    # Returns the Image for a pbm, with whatever SignFetcher left in the store.
+    # If there's nothing there, the Image is stored when store is set.
+    def self.load(pbm, store = false)
+      digest = Digest::SHA1.hexdigest(pbm)
+      image = stored(digest)
+      if !image
+        image = Image.new(digest, pbm2raw(pbm))
+        save(image) if store
+      end
+      image
+    end
+
+    # Plans the packets for an image SignFetcher just fetched, both for
+    # drawing it from scratch and for updating the image it replaces, and
+    # leaves them in the store.
+    def self.precompute(pbm, old_pbm = nil)
+      image = load(pbm)
+      old = old_pbm && load(old_pbm) rescue nil
+      for rle in [false, true, :buffered]
+        image.plan(image.dirty_ranges(nil), rle)
+        image.plan(image.dirty_ranges(old), rle) if old
+        # Radishes that can't flip between pages only get the first.
+        if image.pages > 1
+          first = PacketPlanner::PAGE_BYTES
+          image.plan(PacketPlanner.clip_ranges(image.dirty_ranges(nil), first),
+                     rle)
+          if old
+            image.plan(PacketPlanner.clip_ranges(image.dirty_ranges(old),
+                                                 first), rle)
+          end
+        end
+      end
+      save image
+    end
+
+    # Writes an Image and its plans to the store.
+    def self.save(image)
+      begin
+        Dir.mkdir store
+      rescue Errno::EEXIST
+      end
+      # SignFetcher may be doing several images at once.
+      tmp = store + "tmp#{$$}-#{Thread.current.object_id}"
+      File.open(tmp, 'wb') { |f| f.write encode(image) }
+      File.rename tmp, store + image.digest
+
+      # Clean out images nobody has fetched in a long time.
+      for file in Dir[store + '*']
+        begin
+          File.unlink file if Time.now - File.mtime(file) > STORE_MAX_AGE
+        rescue SystemCallError
+          # another thread beat us to it
+        end
+      end
+      image
+    rescue SystemCallError => e
+      puts "Couldn't store image #{image.digest}: #{e.inspect}"
+      STDOUT.flush
+      image
+    end
+
+    def initialize
+      @lock = Mutex.new
+      # keyed by digest
+      @images = {}
+      # digests, least recently used first
+      @recent = []
+      # keyed by filename, value is [stat, image]
+      @files = {}
+    end
+
+    # Returns the Image in a pbm file, or nil if there's no such file. The
+    # file is only read when it has changed since last time.
+    def image(file)
+      stat = File.stat(file) rescue nil
+      return nil if stat.nil?
+      stat = [stat.ino, stat.mtime, stat.size]
+
+      @lock.synchronize do
+        cached = @files[file]
+        if cached and cached[0] == stat
+          image = cached[1]
+        else
+          pbm = File.open(file, 'rb') { |f| f.read }
+          digest = Digest::SHA1.hexdigest(pbm)
+          # Store it, so it can be found by digest after a restart.
+          image = @images[digest] || PacketCache.load(pbm, true)
+          @files[file] = [stat, image]
+        end
+        remember image
+      end
+    end
+
+    # Returns the Image with the given digest, from memory or the store, or nil
+    # if we don't have it.
+    def image_for(digest)
+      @lock.synchronize do
+        image = @images[digest] || PacketCache.stored(digest)
+        image && remember(image)
+      end
+    end
+
+    private
+
+    def remember(image)
+      @recent.delete image.digest
+      @recent << image.digest
+      @images[image.digest] = image
+      @images.delete @recent.shift while @recent.length > MAX_IMAGES
+      image
+    end
+  end
+end
@@ -0,0 +1,439 @@
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+module Radish
+  # Turns a raw image into the list of display commands that get sent to a
+  # radish, one command per radio packet. Runs of identical bytes go out as
+  # memory fill commands, everything else as memory writes. Radishes that
+  # understand run-length encoded packets get their writes compressed.
+  class PacketPlanner
+    # 100 bytes, minus 3 for new protocol overhead, minus 3 for the
+    # write-to-memory command = 94 payload bytes
+    WRITE_CHUNK = 94
+
+    # The most command bytes that fit in one radio packet, counting the
+    # write-to-memory header but not the command_length byte.
+    MAX_COMMAND = WRITE_CHUNK + 3
+
+    # The screen is 320x240, one bit per pixel, a row at a time.
+    SCREEN_WIDTH = 320
+    SCREEN_HEIGHT = 240
+    ROW_BYTES = SCREEN_WIDTH / 8
+
+    # Set in command_length when the command is PackBits encoded.
+    RLE_FLAG = 0x80
+
+    # First firmware revision that decodes RLE_FLAG packets.
+    RLE_REVISION = 25
+
+    # Longest repeat we'll ask the radish to expand. It doesn't read the
+    # UART while expanding, and only has a two byte FIFO. 8 bytes of SPI at
+    # 250kHz take about as long as 2 bytes of UART at 57600 baud.
+    RLE_MAX_REPEAT = 8
+
+    # First firmware revision that takes UART bytes from an interrupt and
+    # keeps them in a ring buffer, so it can expand longer repeats.
+    BUFFERED_REVISION = 26
+
+    # Size of that buffer (RX_BUFFER_SIZE in xbee.c), less a few bytes the
+    # interrupt handler might not have got to yet.
+    RX_BUFFER = 32 - 4
+
+    # UART bytes that arrive while one byte goes out over SPI: 32uS at
+    # 250kHz against 174uS at 57600 baud, rounded up.
+    UART_PER_SPI = 0.2
+
+    # The longest repeat PackBits can describe.
+    PACKBITS_MAX_REPEAT = 128
+
+    # Capability bits at the end of the hello, from main.h.
+    CAP_RLE = 0x01
+    CAP_RX_BUFFER = 0x02
+    CAP_SPI_FAST = 0x04
+    CAP_PARTIAL_REFRESH = 0x08
+    CAP_PAGES = 0x10
+
+    # Bits in the options packet (SOH), from main.h.
+    OPT_SPI_FAST = 0x01
+    OPT_PAGES = 0x02
+
+    # Radishes with CAP_PAGES keep up to MAX_PAGES screens in display RAM,
+    # back to back from 0, and show them in turn while they sleep. The ETX
+    # says how many there are, with PAGES_ROTATE set to start over after
+    # the last, and how long to show each for, in FLIP_TICKS of the 31kHz
+    # clock.
+    PAGE_BYTES = ROW_BYTES * SCREEN_HEIGHT
+    MAX_PAGES = 6
+    PAGES_ROTATE = 0x80
+    FLIP_TICKS = 1 << 13
+
+    # With RLE, a run costs a quarter of its length in the packet stream, so
+    # it has to be much longer before a fill packet is worth it.
+    RLE_MIN_FILL_RUN = 160
+
+    # Rough on-air cost of a radio packet beyond the bytes we put in it: the
+    # 802.15.4 MAC header and FCS with 64-bit addressing, the PHY preamble,
+    # and the MAC-level ACK coming back.
+    PACKET_OVERHEAD = 30
+
+    # STX and the sequence byte, which ride along in front of every command.
+    HEADER_BYTES = 2
+
+    # {length 0x00 offset_high offset_low data...}
+    WRITE_COST = PACKET_OVERHEAD + HEADER_BYTES + 4
+    # {length 0x01 start_high start_low end_high end_low fill_byte}
+    FILL_COST = PACKET_OVERHEAD + HEADER_BYTES + 7
+
+    # Runs shorter than this are never worth breaking a memory write for, so
+    # the planner doesn't bother considering them.
+    MIN_FILL_RUN = 8
+
+    # Unchanged bytes between two dirty ranges are resent rather than
+    # skipped when the gap is smaller than this. Every extra memory write
+    # costs 4 bytes of command header plus the STX and sequence bytes.
+    DIRTY_MERGE_GAP = 6
+
+    def self.memory_write_packet(start_offset, data)
+      [data.length + 3, 0x00, start_offset, data].pack('CCna*')
+    end
+
+    def self.memory_fill_packet(start_offset, length, fill_byte)
+      [6, 0x01, start_offset,
+        start_offset + length - 1, fill_byte
+      ].pack('CCnnC')
+    end
+
+    def self.display_fullscreen_packet(start_offset)
+      [3, 0x18, start_offset].pack('CCn')
+    end
+
+    # Refreshes just the [x0, y0, x1, y1] box of the screen, corners
+    # included.
+    def self.display_area_packet(start_offset, box)
+      [11, 0x19, start_offset, *box].pack('CCnnnnn')
+    end
+
+    # The smallest [x0, y0, x1, y1] box, corners included, that holds all
+    # the [offset, length] ranges of a screen, or nil if they're empty. A
+    # range that wraps onto another row takes the whole width.
+    def self.bounding_box(ranges)
+      x0, y0, x1, y1 = ROW_BYTES, SCREEN_HEIGHT, -1, -1
+      for offset, length in ranges
+        next if length <= 0
+        row0, col0 = offset.divmod ROW_BYTES
+        row1, col1 = (offset + length - 1).divmod ROW_BYTES
+        col0, col1 = 0, ROW_BYTES - 1 if row0 != row1
+        x0 = col0 if col0 < x0
+        x1 = col1 if col1 > x1
+        y0 = row0 if row0 < y0
+        y1 = row1 if row1 > y1
+      end
+      return nil if x1 < 0
+      [x0 * 8, y0, x1 * 8 + 7, y1]
+    end
+
+    # Same as memory_write_packet, but with the command PackBits encoded,
+    # and only as much of the start of data as fits in a packet. Returns
+    # [packet, bytes of data it covers].
+    def self.rle_write_prefix(start_offset, data, buffered = false)
+      encoded, used = packbits([0x00, start_offset].pack('Cn') + data,
+                               buffered, MAX_COMMAND)
+      [[RLE_FLAG | encoded.length, encoded].pack('Ca*'), used - 3]
+    end
+
+    # PackBits, except that repeats are capped at RLE_MAX_REPEAT. Two-byte
+    # repeats are only used when they don't break up a literal, since they
+    # cost the same either way.
+    #
+    # If the radish is buffered, repeats can be as long as the buffer allows.
+    # backlog is roughly how full it is, assuming the radio keeps the UART
+    # busy: expanding a repeat fills it, and anything else drains it, since
+    # the radish can put bytes out over SPI faster than they come in.
+    #
+    # Encoding stops before it grows past room bytes, if room is given.
+    # Returns [encoded, bytes of data it covers].
+    def self.packbits(data, buffered = false, room = nil)
+      out = ''
+      literal = ''
+      backlog = 0.0
+      flush = proc {
+        if !literal.empty?
+          out << [literal.length - 1, literal].pack('Ca*')
+          backlog -= literal.length + 1 - literal.length * UART_PER_SPI
+          backlog = 0.0 if backlog < 0
+          literal = ''
+        end
+      }
+      i = 0
+      while i < data.length
+        byte = data[i, 1]
+        limit = RLE_MAX_REPEAT
+        if buffered
+          limit = [((RX_BUFFER - backlog) / UART_PER_SPI).to_i,
+                   PACKBITS_MAX_REPEAT].min
+        end
+        run = 1
+        while run < limit and data[i + run, 1] == byte
+          run += 1
+        end
+        # What the encoding comes to so far, once the literal is flushed.
+        size = out.length + (literal.empty? ? 0 : literal.length + 1)
+        if run >= 3 or (run == 2 and literal.empty?)
+          break if room and size + 2 > room
+          flush.call
+          out << [257 - run, byte].pack('Ca')
+          backlog = [backlog + run * UART_PER_SPI - 2, 0.0].max
+          i += run
+        else
+          break if room and size + (literal.empty? ? 2 : 1) > room
+          literal << byte
+          flush.call if literal.length == 128
+          i += 1
+        end
+      end
+      flush.call
+      [out, i]
+    end
+
+    # Returns a sorted list of [offset, length] pairs covering every byte
+    # that differs between two raw images. If there's nothing to compare
+    # against, the whole image is dirty.
+    def self.dirty_ranges(old, new)
+      return [[0, new.length]] if old.nil? or old.length != new.length
+
+      ranges = []
+      block = 16
+      (0...new.length).step(block) do |b|
+        # Most of the screen doesn't change, so skip over it a block at a
+        # time before looking at individual bytes.
+        next if old[b, block] == new[b, block]
+        (b...[b + block, new.length].min).each do |i|
+          next if old[i, 1] == new[i, 1]
+          if !ranges.empty? and ranges[-1][0] + ranges[-1][1] == i
+            ranges[-1][1] += 1
+          else
+            ranges << [i, 1]
+          end
+        end
+      end
+      merge_ranges(ranges)
+    end
+
+    # Sorts and joins overlapping ranges, as well as ranges that are within
+    # DIRTY_MERGE_GAP bytes of each other.
+    def self.merge_ranges(ranges)
+      merged = []
+      for offset, length in ranges.sort
+        last = merged[-1]
+        if last and offset <= last[0] + last[1] + DIRTY_MERGE_GAP
+          last[1] = [last[1], offset + length - last[0]].max
+        else
+          merged << [offset, length]
+        end
+      end
+      merged
+    end
+
+    # Estimated bytes on air for a list of command packets.
+    def self.cost(packets)
+      packets.inject(0) do |sum, packet|
+        sum + PACKET_OVERHEAD + HEADER_BYTES + packet.length
+      end
+    end
+
+    # What a radish can do, from the capabilities in its hello. Radishes
+    # from before there were capabilities send nil, so go by the revision.
+    def self.capabilities(revision, caps)
+      return caps if caps
+      caps = 0
+      caps |= CAP_RLE if revision >= RLE_REVISION
+      caps |= CAP_RX_BUFFER if revision >= BUFFERED_REVISION
+      caps
+    end
+
+    # The :rle option for a radish with the given capabilities.
+    def self.rle_mode(caps)
+      if caps & CAP_RLE == 0
+        nil
+      elsif caps & CAP_RX_BUFFER != 0
+        :buffered
+      else
+        true
+      end
+    end
+
+    # The options packet to send a radish with the given capabilities first,
+    # or nil if there's nothing to turn on.
+    def self.options_packet(caps)
+      options = 0
+      options |= OPT_SPI_FAST if caps & CAP_SPI_FAST != 0
+      options |= OPT_PAGES if caps & CAP_PAGES != 0
+      return nil if options == 0
+      [1, options].pack('CC')
+    end
+
+    # The page schedule that goes after the sleep bytes in the ETX, for
+    # radishes that were sent OPT_PAGES. flip is the seconds to show each
+    # page for, or nil to leave it to the app button, and clock how fast the
+    # radish's clock runs (see ClockCalibration). Pages only flip when the
+    # radish wakes up between sleeps, which for a 20 minute sleep is about
+    # every 8 seconds, so shorter flips than that come out longer.
+    def self.page_schedule(pages, flip, rotate, clock = 1.0)
+      interval = 0
+      if flip
+        interval = (flip * 31000 * clock / FLIP_TICKS).round
+        interval = [[interval, 1].max, 0xFFFF].min
+      end
+      [pages | (rotate ? PAGES_ROTATE : 0), interval].pack('Cn')
+    end
+
+    # The ranges that fall in the first length bytes.
+    def self.clip_ranges(ranges, length)
+      ranges.map { |offset, size|
+        [offset, [size, length - offset].min]
+      }.select { |offset, size| size > 0 }
+    end
+
+    # Options:
+    #   :rle - Whether the radish can decode RLE_FLAG packets, or :buffered
+    #     if it can also take long repeats. See rle_mode.
+    def initialize(data, options = {})
+      @data = data
+      @rle = options[:rle]
+      @buffered = (@rle == :buffered)
+    end
+
+    # Returns the command packets needed to get the given [offset, length]
+    # ranges of the image into display RAM.
+    def plan(ranges = [[0, @data.length]])
+      packets = []
+      for offset, length in ranges
+        plain = plan_range(offset, offset + length)
+        if @rle
+          # Dithered images can come out bigger encoded, so keep whichever
+          # plan is cheaper.
+          encoded = plan_range_rle(offset, offset + length)
+          plain = encoded if self.class.cost(encoded) < self.class.cost(plain)
+        end
+        packets.concat plain
+      end
+      packets
+    end
+
+    private
+
+    # Finds the cheapest mix of writes and fills covering [start, stop). This
+    # is a shortest-path search from the end of the range back to the start,
+    # where a write may only end at the start of a long run, at the end of
+    # the range, or when it's full. Those are the only places where stopping
+    # a write early can pay off.
+    def plan_range(start, stop)
+      runs = run_lengths(start, stop)
+
+      # best[i] = [cost, kind, next_i] for covering [i, stop)
+      best = []
+      best[stop] = [0, nil, stop]
+      breaks = [stop]  # positions a write may end at, nearest first
+      (stop - 1).downto(start) do |i|
+        limit = i + WRITE_CHUNK
+        # Writes can't reach further than WRITE_CHUNK, so drop far breaks.
+        breaks.pop while !breaks.empty? and breaks[-1] > limit
+
+        choice = nil
+        if runs[i] >= MIN_FILL_RUN
+          j = i + runs[i]
+          choice = [FILL_COST + best[j][0], :fill, j]
+        end
+
+        candidates = breaks
+        candidates += [limit] if limit < stop
+        for j in candidates
+          cost = WRITE_COST + (j - i) + best[j][0]
+          choice = [cost, :write, j] if choice.nil? or cost < choice[0]
+        end
+        best[i] = choice
+
+        # A long run starting here is somewhere a write could usefully stop.
+        if runs[i] >= MIN_FILL_RUN and
+           (i == start or @data[i - 1, 1] != @data[i, 1])
+          breaks.unshift i
+        end
+      end
+
+      packets = []
+      i = start
+      while i < stop
+        kind, j = best[i][1, 2]
+        if kind == :fill
+          fill_byte = @data[i, 1].unpack('C')[0]
+          packets << self.class.memory_fill_packet(i, j - i, fill_byte)
+        else
+          packets << self.class.memory_write_packet(i, @data[i, j - i])
+        end
+        i = j
+      end
+      packets
+    end
+
+    # With RLE, short runs are already cheap, so only really long ones get
+    # a fill. Everything in between is packed into as few encoded writes as
+    # will hold it.
+    def plan_range_rle(start, stop)
+      runs = run_lengths(start, stop)
+      packets = []
+      i = start
+      while i < stop
+        if runs[i] >= RLE_MIN_FILL_RUN
+          fill_byte = @data[i, 1].unpack('C')[0]
+          packets << self.class.memory_fill_packet(i, runs[i], fill_byte)
+          i += runs[i]
+          next
+        end
+
+        # Don't let a write swallow the next long run.
+        j = i
+        j += runs[j] while j < stop and runs[j] < RLE_MIN_FILL_RUN
+
+        # Encode as much as fits, in one pass: the SYN path can't wait for
+        # anything cleverer. A little under a plain write's worth always
+        # fits, so that's the least a packet takes.
+        packet, length = self.class.rle_write_prefix(i, @data[i, j - i],
+                                                     @buffered)
+        least = [WRITE_CHUNK - 4, j - i].min
+        if length < least
+          length = least
+          packet = self.class.memory_write_packet(i, @data[i, length])
+        end
+        packets << packet
+        i += length
+      end
+      packets
+    end
+
+    # runs[i] is the number of identical bytes starting at i, stopping at
+    # stop.
+    def run_lengths(start, stop)
+      runs = []
+      (stop - 1).downto(start) do |i|
+        if i + 1 < stop and @data[i, 1] == @data[i + 1, 1]
+          runs[i] = runs[i + 1] + 1
+        else
+          runs[i] = 1
+        end
+      end
+      runs
+    end
+  end
+end
@@ -45,7 +45,9 @@ module Radish
       puts "Serial is: #{serial}"
     end
 
-    def program_wongle
+    # escaped puts the XBee in escaped API mode (AP=2), for running the
+    # radio server with --escaped.
+    def program_wongle(escaped = false)
       determine_baud
       send_cmd "ATRE\r"
       puts "sleeping 10"
@@ -53,7 +55,7 @@ module Radish
       determine_baud
       send_cmd "ATBD6\r"
       send_cmd "ATSM0\r"
-      send_cmd "ATAP1\r"
+      send_cmd(escaped ? "ATAP2\r" : "ATAP1\r")
       send_cmd "ATWR\r"
       send_cmd "ATCN\r"
     end
@@ -108,9 +110,11 @@ if __FILE__ == $0
   opts = OptionParser.new
   $factory = false
   $wongle  = false
+  $escaped = false
   tty      = nil
   opts.on('--factory', 'Factory Reset') { |v| $factory = v }
   opts.on('--wongle',  'Server Wongle') { |v| $wongle = v }
+  opts.on('--escaped', 'Escaped API mode (AP=2) for --wongle') { |v| $escaped = v }
   opts.on('--tty DEVICE', "Serial line to use [default: #{tty}]") { |v| tty = v }
   opts.parse! ARGV
   tty ||= Radish::Connection.default_port
@@ -118,7 +122,7 @@ if __FILE__ == $0
   if $factory
     radio.factory_reset
   elsif  $wongle
-    radio.program_wongle
+    radio.program_wongle $escaped
   else
     radio.program
   end
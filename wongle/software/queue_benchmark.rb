@@ -0,0 +1,150 @@
+#!/usr/bin/ruby
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Compares ThreadedQueue against the thread-per-burst queue it replaced.
+#
+# Latency is measured the way the radio server sees it: one item at a time,
+# with the queue going idle in between, as when a SYN arrives and the first
+# packet has to get to the writer. Throughput is a burst of items handled
+# back to back.
+#
+#   ./queue_benchmark.rb [latency samples] [throughput items]
+
+$: << File.dirname($0)
+
+require 'benchmark'
+require 'threaded_queue'
+
+module Radish
+  # The old ThreadedQueue, kept here only for comparison. It started a new
+  # thread every time an item arrived at an idle queue.
+  class LegacyThreadedQueue < Array
+    def initialize(*args, &block)
+      @thread_running = false
+      @handler_proc = block
+      @mutex = Mutex.new
+      super(*args)
+    end
+
+    def <<(*args)
+      rv = super(*args)
+
+      @mutex.lock
+      if !@thread_running
+        @thread_running = true
+        @mutex.unlock
+
+        Thread.new do
+          begin
+            @mutex.lock
+            while !empty?
+              @mutex.unlock
+              begin
+                @handler_proc.call
+              ensure
+                @mutex.lock
+              end
+            end
+          ensure
+            @thread_running = false
+            @mutex.unlock
+          end
+        end  # Thread.new
+      else
+        @mutex.unlock
+      end  # if
+
+      return rv
+    end
+
+    def shift
+      @mutex.synchronize { super }
+    end
+  end
+
+  class QueueBenchmark
+    def initialize(samples, items)
+      @samples = samples
+      @items = items
+    end
+
+    # Builds a queue with the block, giving it a handler that drains the
+    # queue. Returns the queue and a proc that waits until n items have been
+    # handled.
+    def make_queue
+      handled = 0
+      lock = Mutex.new
+      done = ConditionVariable.new
+      queue = nil
+      queue = yield(proc do
+        while (item = queue.shift)
+          lock.synchronize do
+            handled += 1
+            @latency << Time.now - item if item.is_a?(Time)
+            done.signal
+          end
+        end
+      end)
+      wait = proc do |n|
+        lock.synchronize { done.wait(lock) while handled < n }
+      end
+      return queue, wait
+    end
+
+    def latency(name, &factory)
+      @latency = []
+      queue, wait = make_queue(&factory)
+      for i in 1..@samples
+        queue << Time.now
+        wait.call(i)
+        # Let the old queue's thread finish, so every item finds it idle.
+        sleep 0.001
+      end
+      @latency.sort!
+      mean = @latency.inject(0) { |sum, t| sum + t } / @latency.length
+      printf("%-8s latency: mean %7.1fus  median %7.1fus  99%% %7.1fus\n",
+             name, mean * 1e6, @latency[@latency.length / 2] * 1e6,
+             @latency[(@latency.length * 99) / 100] * 1e6)
+      STDOUT.flush
+    end
+
+    def throughput(name, &factory)
+      @latency = []
+      queue, wait = make_queue(&factory)
+      elapsed = Benchmark.realtime do
+        @items.times { |i| queue << i }
+        wait.call(@items)
+      end
+      printf("%-8s throughput: %9.0f items/s\n", name, @items / elapsed)
+      STDOUT.flush
+    end
+
+    def run
+      legacy = proc { |handler| LegacyThreadedQueue.new(&handler) }
+      current = proc { |handler| ThreadedQueue.new(&handler) }
+      latency('legacy', &legacy)
+      latency('current', &current)
+      throughput('legacy', &legacy)
+      throughput('current', &current)
+    end
+  end
+end
+
+if __FILE__ == $0
+  samples = (ARGV[0] || 2000).to_i
+  items = (ARGV[1] || 200000).to_i
+  Radish::QueueBenchmark.new(samples, items).run
+end
@@ -18,7 +18,13 @@ $: << File.dirname($0)
 
 require 'daemon'
 require 'api'
+require 'clock_calibration'
 require 'connection'
+require 'energy_scheduler'
+require 'log_shipper'
+require 'metrics'
+require 'packet_cache'
+require 'session_store'
 require 'net/http'
 require 'timeout'
 require 'yaml'
@@ -29,31 +35,138 @@ module Radish
   class RadioServer < Daemon
     include Ascii
     # conversion factor for A/D sampling
-    VOLTS_PER_BIT = 3.02 / 255.0
+    VOLTS_PER_BIT = EnergyScheduler::FULL_VOLTS / 255.0
     DEGREE_F_PER_VOLT = 1.8 / 0.01  # .01 Volts/degree C
+    # Below these a radish can't update its screen. Newer boards (with
+    # temperature sensors) can go as low as 1.4V, the old ones poop out at
+    # 2V.
+    MIN_VOLTS = 1.4
+    MIN_VOLTS_OLD_BOARD = 2.0
+    # When SignFetcher knows when a sign's image is going to change, the
+    # radish wakes up this long after, once the new one's been fetched.
+    WAKE_AFTER_CHANGE = 30
+    # failure_mode byte in a NAK, from main.h
+    FAILURES = {0 => 'no header', 1 => 'overrun'}
     DEFAULT_WANGLER_URL = nil # central management url for a cluster of wongles
+    # SignFetcher tells us when it installs an image, but if we miss that
+    # we'll still notice the file has changed within this many seconds.
+    IMAGE_RECHECK = 600
+    # Partial refreshes leave a little ghosting behind on the panel, so
+    # after this many in a row the whole screen gets refreshed.
+    FULL_REFRESH_EVERY = 10
+    # A window bigger than this much of the screen gets a full refresh.
+    MAX_PARTIAL_AREA = 0.5
     #DEFAULT_WANGLER_URL = 'http://example.com:9999/wangler'
 
-    attr_accessor :wangler_uri, :debug_level, :tty
+    attr_accessor :wangler_uri, :debug_level, :tty, :escaped
+
+    # Port the metrics are served on, or nil for none.
+    attr_accessor :metrics_port
+
+    # The feed for each radish we serve, keyed by mac. Normally this comes
+    # from the wangler. An entry is a URL, or a Hash with 'url' and
+    # optionally 'interval' (see SignFetcher), 'flip' (seconds to show each
+    # page of a multi-page image for) and 'rotate' (start over after the
+    # last page).
+    attr_accessor :feedurls
+
+    # Where to record the serial line for replay.rb, or nil for nowhere.
+    attr_accessor :capture_file
+
+    # The Connection to the XBee. Normally connect makes one.
+    attr_accessor :connection
 
     def initialize
       super
       never = Time.at 0
-      # TODO have @lastsync survive restarts
       # keyed by remote radio address, value is epoch time
       @lasttry  = Hash.new { |h,k| never }
       @lastsync = Hash.new { |h,k| never }
+      # keyed by remote radio address, value is the PacketCache::Image the
+      # radish last acknowledged, i.e. what's sitting in its display RAM
+      @screens = {}
+      # keyed by remote radio address, value is [image, ranges, partial,
+      # pages] for the transfer that hasn't been acknowledged yet
+      @inflight = {}
+      # keyed by remote radio address, value is [key, first, options] for
+      # the transfer in @inflight: [digest, rle, ranges] for what it's
+      # drawing, the first of the command packets it started at, and
+      # whether it sent an options packet ahead of them
+      @transfers = {}
+      # keyed by remote radio address, value is the number of partial
+      # refreshes since the last full one
+      @partials = Hash.new { |h,k| 0 }
+      # keyed by remote radio address, value is how many pages the radish
+      # flips between while it sleeps, from the last transfer it took
+      @pages = Hash.new { |h,k| 1 }
+      # keyed by remote radio address, value is a list of [offset, length]
+      # ranges that an unacknowledged transfer may have scribbled over
+      @stale = Hash.new { |h,k| [] }
+      # keyed by remote radio address, value is the last Api::Response sent
+      @responses = {}
+      @cache = PacketCache.new
+      # keyed by remote radio address, value is [image, changed, checked]
+      # for the image in its .pbm file: when SignFetcher installed it, and
+      # when we last looked at the file
+      @images = {}
+      @images_lock = Mutex.new
+      @sessions = SessionStore.new
+      @energy = EnergyScheduler.new
+      @clocks = ClockCalibration.new
+      # keyed by remote radio address, value is when SignFetcher expects
+      # the image to change next
+      @next_change = {}
+      # keyed by remote radio address, value is the Api::Link state saved
+      # before we restarted
+      @saved_links = {}
+      @api = nil
       @connection = nil
-      @tty = Connection.default_port
+      @capture_file = nil
+      # Not finding a wongle only matters if we connect to it.
+      @tty = Connection.default_port rescue nil
+      @escaped = false
       @feedurls = read_feedurls
       @myaddr = read_my_addr
       @wangler_uri = nil
-      @logentries = ThreadedQueue.new(&method(:sync_with_wangler))
+      @shipper = nil
       @debug_level = 0
+      @metrics = Metrics.new
+      @metrics_port = Metrics::DEFAULT_PORT
+      describe_metrics
+    end
+
+    # Picks up what we knew about each radish before we restarted.
+    def restore_sessions
+      for radio, session in @sessions.load
+        @lasttry[radio] = session['lasttry'] if session['lasttry']
+        @lastsync[radio] = session['lastsync'] if session['lastsync']
+        # The image may have been cleaned out of the packet store, but if
+        # it hasn't changed it's still in the radish's .pbm file. Otherwise
+        # the radish just gets the whole screen, as it does if the .pbm is
+        # no good.
+        if (digest = session['screen'])
+          begin
+            screen = @cache.image_for(digest) ||
+              @cache.image(basedir + radio + '.pbm')
+          rescue => e
+            puts "could not restore screen for #{radio}: #{e}"
+            screen = nil
+          end
+          @screens[radio] = screen if screen and screen.digest == digest
+        end
+        @stale[radio] = session['stale'] if session['stale']
+        @partials[radio] = session['partials'] if session['partials']
+        @pages[radio] = session['pages'] if session['pages']
+        @energy.restore radio, session
+        @clocks.restore radio, session
+        @next_change[radio] = session['next_change'] if session['next_change']
+        @saved_links[radio] = session
+      end
     end
 
     def connect
-      @connection = Connection.new(@tty)
+      @connection = Connection.new(@tty || Connection.default_port)
+      @connection.capture = Capture.new(@capture_file) if @capture_file
     end
 
     # get our own radio address
@@ -67,67 +180,37 @@ module Radish
       # prime the feed urls in case we cannot contact the
       # wangler.  This data gets reloaded after the next contact
       # with the wangler.
-      YAML.load(File.read(BASEDIR + 'feedurls')) rescue {}
+      YAML.load(File.read(basedir + 'feedurls')) rescue {}
     end
 
-    # run by a separate thread
-    # and sends logs to wangler and
-    # receives @feedurls
-    def sync_with_wangler
-      sending = @logentries.to_a
-      begin
-        http = Net::HTTP.new @wangler_uri.host, @wangler_uri.port
-        http.read_timeout = 20
-        if @wangler_uri.scheme == 'https'
-          http.use_ssl = true
-          http.ca_path = '/etc/ssl/certs'
-          http.verify_mode = OpenSSL::SSL::VERIFY_PEER
+    # Called by the LogShipper thread with each response from the wangler,
+    # which has the feedurls.
+    def update_feedurls(res)
+      new_urls = YAML.load res.body
+
+      # compare hashes - handles add/delete/change
+      (@feedurls.keys + new_urls.keys).uniq.each do |radish|
+        old_url = @feedurls[radish]
+        new_url = new_urls[radish]
+        next if new_url == old_url
+        log_radish_change radish, old_url, new_url
+
+        # require screen update on next checkin
+        # side effect: cleans up turds on disassociation
+        if old_url
+          @lastsync[radish] = Time.at 0
+          # TODO: maybe SignFetcher should do the unlink?
+          # but this makes url changes happen way faster
+          File.unlink basedir + radish + '.pbm' rescue nil
+          @images_lock.synchronize { @images.delete radish }
         end
-        res = http.request_post @wangler_uri.request_uri, sending.to_yaml
-
-        case res
-        when Net::HTTPSuccess
-          new_urls = YAML.load res.body
-        else
-          res.error!
-        end
-
-        # compare hashes - handles add/delete/change
-        (@feedurls.keys + new_urls.keys).uniq.each do |radish|
-          old_url = @feedurls[radish]
-          new_url = new_urls[radish]
-          next if new_url == old_url
-          log_radish_change radish, old_url, new_url
-
-          # require screen update on next checkin
-          # side effect: cleans up turds on disassociation
-          if old_url
-            @lastsync[radish] = Time.at 0
-            # TODO: maybe SignFetcher should do the unlink?
-            # but this makes url changes happen way faster
-            File.unlink BASEDIR + radish + '.pbm' rescue nil
-          end
-        end
-
-        # update file and kick sign_fetcher if necessary
-        if @feedurls != new_urls
-          @feedurls = new_urls
-          File.open(BASEDIR + 'feedurls','w') { |f| f.write res.body }
-          notify_sign_fetcher
-        end
-
-        # Removes the entries we just posted. Low-level operations like array
-        # slicing are atomic, so this is thread-safe.
-        @logentries.slice! 0, sending.length
-
-      rescue StandardError, Timeout::Error => ex
-        puts "Exception talking to wangler (at %s): %s" %
-          [@wangler_uri, ex.inspect]
-        STDOUT.flush
+      end
 
-        # since we are not running in the main thread,
-        # we can sleep here.
-        sleep 3
+      # update file and kick sign_fetcher if necessary
+      if @feedurls != new_urls
+        @feedurls = new_urls
+        File.open(basedir + 'feedurls','w') { |f| f.write res.body }
+        notify_sign_fetcher
       end
     end
 
@@ -139,6 +222,8 @@ module Radish
     # wake up the sign fetcher
     # this is called if the feedurls file has changed
     def notify_sign_fetcher
+      return if send_message 'SignFetcher', 'reload'
+      # it's not listening, so try the old-fashioned way
       begin
         pid = readpid 'SignFetcher'
         Process.kill 'HUP', pid
@@ -159,7 +244,8 @@ module Radish
 
       if @wangler_uri
         # schedule the same data to be sent up to the wangler
-        @logentries << {
+        @shipper ||= LogShipper.new(@wangler_uri, &method(:update_feedurls))
+        @shipper << {
           'time' => now.to_f,
           'wongle' => @myaddr,
           'mac' => radish,
@@ -169,27 +255,139 @@ module Radish
       end
     end
 
-    # convert pbm format to radish image format
-    def pbm2raw(pbm)
-      # since pbm is so similar, conversion is easy
-      header, *data = pbm.unpack('A11C*')
-      data.map! { |v| 255 - v } # invert bits
-      raise 'BadImage' if header != "P4\n320 240\n" or data.length != 9600
-      return data.pack('C*')
+    # SignFetcher sends "image <mac> <digest>" when it installs a new image.
+    def handle_message(message)
+      kind, radio, digest = message.split
+      if kind == 'next' and digest
+        # "next mac time": when the sign's image is due to change
+        @next_change[radio] = Time.at(digest.to_i)
+        @sessions.update radio, 'next_change' => @next_change[radio]
+        return
+      end
+      if kind != 'image' or digest.nil?
+        puts "unknown message #{message.inspect}"
+        STDOUT.flush
+        return
+      end
+      # We're not in a hurry here, so this is where images get loaded.
+      image = @cache.image_for digest
+      now = Time.now
+      @images_lock.synchronize do
+        if image
+          @images[radio] = [image, now, now]
+        else
+          # SignFetcher didn't manage to store it, so read the file.
+          @images.delete radio
+        end
+      end
+    end
+
+    # Returns the Image in a radish's .pbm file and when it last changed, or
+    # nil if there isn't one. Normally SignFetcher has told us, so this
+    # doesn't have to touch the disk.
+    def current_image(radio)
+      @images_lock.synchronize do
+        entry = @images[radio]
+        if entry and Time.now - entry[2] < IMAGE_RECHECK
+          return entry[0], entry[1]
+        end
+      end
+
+      file = basedir + radio + '.pbm'
+      image = @cache.image file
+      changed = File.mtime file rescue nil
+      @images_lock.synchronize do
+        if image.nil? or changed.nil?
+          @images.delete radio
+          return nil
+        end
+        @images[radio] = [image, changed, Time.now]
+      end
+      return image, changed
     end
 
-    def memory_write_packet(start_offset, data)
-      [data.length + 3, 0x00, start_offset, data].pack('CCna*')
+    # Figures out which parts of the image need to go out to the radish.
+    # We diff against what it last acknowledged, plus anything a failed
+    # transfer might have left half-written.
+    def screen_ranges(radio, image, full)
+      if (inflight = @inflight.delete radio)
+        @stale[radio] = PacketPlanner.merge_ranges(@stale[radio] +
+                                                   inflight[1])
+      end
+      return image.dirty_ranges(nil) if full
+      PacketPlanner.merge_ranges(image.dirty_ranges(@screens[radio]) +
+                                 @stale[radio])
     end
 
-    def memory_fill_packet(start_offset, length, fill_byte)
-      [6, 0x01, start_offset,
-        start_offset + length - 1, fill_byte
-      ].pack('CCnnC')
+    # How long a radish should sleep after this wakeup, which costs it about
+    # cost volts. floor is where it browns out. If we know when its image
+    # changes next, there's no point waking it before then, and it should
+    # wake as soon after as it can afford to. pages is how many it'll flip
+    # between while it sleeps, each flip costing a refresh.
+    def sleep_for(radio, floor, cost, pages = @pages[radio])
+      wanted = nil
+      if (change = @next_change[radio]) and change > Time.now
+        wanted = (change - Time.now).ceil + WAKE_AFTER_CHANGE
+      end
+      flip = pages > 1 ? flip_seconds(radio) : nil
+      seconds = @energy.sleep_time(radio, floor, cost, wanted, flip)
+      @sessions.update radio, @energy.state(radio)
+      seconds
     end
 
-    def display_fullscreen_packet(start_offset)
-      [3, 0x18, start_offset].pack('CCn')
+    # How long a radish shows each page for, going by its feedurls entry, or
+    # nil if only the app button flips them.
+    def flip_seconds(radio)
+      feed = @feedurls[radio]
+      feed.is_a?(Hash) ? feed['flip'] : nil
+    end
+
+    # A CAN that puts a radish to sleep, corrected for its clock. We know
+    # when it goes to sleep, so the next hello tells us how fast its clock
+    # really is, unless it flips pages in between: each flip stops the
+    # clock for a refresh.
+    def cancel(radio, sleep_time)
+      response = Api.cancel(sleep_time)
+      response.clock = @clocks.rate(radio)
+      @clocks.expect radio, @pages[radio] > 1 ? nil : response.nominal_sleep
+      response
+    end
+
+    # How many of a transfer's command packets to skip, because the radish
+    # got them last time. If the last transfer died and this one is drawing
+    # the same thing, what it got through is still in the display RAM.
+    # last_count from the hello says how many packets the radish took in
+    # order, but the last of those may have been cut off. It wraps after
+    # 256, which can only make us send more than we need to. A power-on or a
+    # reset may have lost the display RAM, so those start over.
+    def resume_point(radio, key, buttons, last_count, commands)
+      transfer = @transfers.delete radio
+      return 0 if transfer.nil? or transfer[0] != key or last_count.nil?
+      return 0 if buttons & 0xC0 != 0
+      first, options = transfer[1], transfer[2]
+      # last_count is one less than the radish's seq_num.
+      whole = (last_count + 1) & 0xFF
+      whole -= 1 if whole > 0  # the one that may have been cut off
+      whole -= 1 if options and whole > 0
+      # Always send at least one, so the response isn't empty.
+      [first + whole, commands - 1].min
+    end
+
+    # The box to refresh after sending the given ranges, or nil if the
+    # whole screen should be. There's only ever one refresh, since the radish
+    # can't take anything after a refresh until it's done, so changes all
+    # over the screen share a box.
+    def partial_refresh(radio, caps, ranges, pages)
+      return nil if caps & PacketPlanner::CAP_PARTIAL_REFRESH == 0
+      return nil if @partials[radio] >= FULL_REFRESH_EVERY
+      # A radish flipping between pages could be showing any of them.
+      return nil if pages > 1 or @pages[radio] > 1
+      box = PacketPlanner.bounding_box(ranges)
+      return nil if box.nil?
+      area = (box[2] - box[0] + 1) * (box[3] - box[1] + 1)
+      return nil if area > MAX_PARTIAL_AREA * PacketPlanner::SCREEN_WIDTH *
+        PacketPlanner::SCREEN_HEIGHT
+      box
     end
 
     # new request
@@ -203,10 +401,41 @@ module Radish
 
       # decode and log response
       @lasttry[radio] = Time.now
-      syn, rev, power, buttons, last_count, temp = packet.data.unpack 'CnCCCC'
+      syn, rev, power, buttons, last_count, temp, caps =
+        packet.data.unpack 'CnCCCCC'
+      caps = PacketPlanner.capabilities(rev, caps)
+      volts = power * VOLTS_PER_BIT
+      old_board = (temp == nil or temp == 0)
+      floor = old_board ? MIN_VOLTS_OLD_BOARD : MIN_VOLTS
+      predicted = @energy.sample(radio, volts, temp)
+      slept = @clocks.expected(radio)
+      clock = @clocks.wakeup(radio, buttons)
+      if clock
+        @sessions.update radio, @clocks.state(radio)
+      end
+      # Any kind of reset makes the radish forget its page schedule.
+      if buttons and buttons & 0xE0 != 0 and @pages.delete radio
+        @sessions.update radio, 'pages' => nil
+      end
+      # The sample we recieve is the low 8 bits, in the voltage range .375V
+      # to 1.125V. This is 4x the sensitivity of the cap reading, so we have
+      # to multiply my 1/4 relative to VOLTS_PER_BIT. The offset of 32 is to
+      # properly align the range, since it's shifted. We also special case
+      # 0, since that's the signal that there's no sensor installed on the
+      # board.
+      # .01 V/degree C, 0V = -50C = -58F
+      if !old_board
+        degrees = (temp + 128) * (VOLTS_PER_BIT / 4) * DEGREE_F_PER_VOLT - 58
+      end
       log packet, 'request', {
-        'voltage'=> "%4.2f" % [power * VOLTS_PER_BIT],
+        'voltage'=> "%4.2f" % [volts],
+        # what the energy scheduler expected when it put the radish to sleep
+        'predicted' => predicted && ("%4.2f" % [predicted]),
+        # how long it should have slept, and how fast its clock turned out
+        'slept' => slept && slept.round,
+        'clock' => clock && ("%5.3f" % [clock]),
         'revision'=> rev,
+        'caps' => "0b%08b" % caps,
         'buttons' => buttons && ("0b%08b" % buttons),
         'reason' =>
           if    buttons & 128 != 0
@@ -222,26 +451,13 @@ module Radish
           else
             'unknown'
           end,
-        # The sample we recieve is the low 8 bits, in the voltage range .375V
-        # to 1.125V. This is 4x the sensitivity of the cap reading, so we have
-        # to multiply my 1/4 relative to VOLTS_PER_BIT. The offset of 32 is to
-        # properly align the range, since it's shifted. We also special case
-        # 0, since that's the signal that there's no sensor installed on the
-        # board.
-        # .01 V/degree C, 0V = -50C = -58F
-        'temp' =>
-          if temp == nil
-            nil
-          elsif temp == 0
-            "0"
-          else
-            "%5.1f" % [(temp + 128) * (VOLTS_PER_BIT / 4) *
-                       DEGREE_F_PER_VOLT - 58]
-          end,
+        'temp' => degrees ? "%5.1f" % [degrees] : temp && temp.to_s,
       }
-
-      # locate file
-      file = BASEDIR + radio + '.pbm'
+      labels = {'mac' => radio}
+      @metrics.set 'radish_cap_volts', volts, labels
+      @metrics.set 'radish_temperature_fahrenheit', degrees, labels
+      @metrics.set 'radish_rssi_dbm', -packet.signalstrength, labels
+      @metrics.count 'radish_wakeups_total', labels
 
       # don't respond to radishes we don't service it
       url = @feedurls[radio]
@@ -249,59 +465,103 @@ module Radish
         log packet, 'ignore'
         return nil
       end
-
-      # Go sleep if the radish is low on power
-      if power * VOLTS_PER_BIT < 1.4
-        log packet, 'cancel', {'reason' => 'power'}
-        return Api.cancel(1200)
-      end
-
-      # Newer boards (with temperature sensors) can perform screen updates at
-      # a much lower voltage. (As low as 1.4V.) Perform this second check for
-      # the old boards that poop out at 2V.
-      if power * VOLTS_PER_BIT < 2.0 and (temp == nil or temp == 0)
-        log packet, 'cancel', {'reason' => 'power - old board'}
-        return Api.cancel(1200)
+      url = url['url'] if url.is_a? Hash
+
+      # Go sleep if the radish is low on power, until it's had time to
+      # charge up again.
+      if volts < floor
+        sleep_time = sleep_for(radio, floor, EnergyScheduler::CHECK_COST)
+        log packet, 'cancel', {'sleep' => sleep_time, 'reason' =>
+          volts < MIN_VOLTS ? 'power' : 'power - old board'}
+        return cancel(radio, sleep_time)
       end
 
       # Don't send image if we're still waiting on sign_fetcher
       # TODO: display welcome image instead
       # while waiting for sign_fetcher
-      if ! File.exists? file
+      image, changed = current_image radio
+      if image.nil?
         log packet, 'cancel', {'reason' => 'missing file'}
-        return Api.cancel(30)
+        return cancel(radio, 30)
+      end
+
+      # A power-on reset means the display RAM is garbage, so we can't
+      # send a partial update.
+      full = (buttons and buttons & 128 != 0)
+      if full and @screens.delete radio
+        @sessions.update radio, 'screen' => nil
       end
 
       # Don't send image if contents haven't changed
-      if @lastsync[radio] > File.mtime(file)
+      if @lastsync[radio] > changed
         if buttons and (buttons & 0x41 == 0x41)
           # Override if we just got reset AND are holding the app button
           log packet, 'override', {'reason' => 'secret combo engaged'}
+          full = true
         else
-          log packet, 'cancel', {'reason' => 'no change'}
-          return Api.cancel(1200)
+          sleep_time = sleep_for(radio, floor, EnergyScheduler::CHECK_COST)
+          log packet, 'cancel',
+            {'reason' => 'no change', 'sleep' => sleep_time}
+          return cancel(radio, sleep_time)
         end
       end
 
-      data_pbm = File.read file
-      data = pbm2raw(data_pbm)
-
-      # 100 bytes, minus 3 for new protocol overhead, minus 3 for the
-      # write-to-memory command = 94 payload bytes
-      last_packet = (data.length - 1) / 94
-      phase0 = (0..last_packet).map do |x|
-        position = x * 94
-        data_chunk = data[position, 94]
-        memory_write_packet(position, data_chunk)
+      # Only send the parts of the screen that changed since the last
+      # update the radish acknowledged. Radishes that can flip between pages
+      # get all of them, and the rest just the first.
+      pages = caps & PacketPlanner::CAP_PAGES != 0 ? image.pages : 1
+      ranges = PacketPlanner.clip_ranges(screen_ranges(radio, image, full),
+                                         pages * PacketPlanner::PAGE_BYTES)
+      if ranges.empty?
+        sleep_time = sleep_for(radio, floor, EnergyScheduler::CHECK_COST)
+        log packet, 'cancel', {'reason' => 'no change', 'sleep' => sleep_time}
+        return cancel(radio, sleep_time)
       end
-      phase1 = [display_fullscreen_packet(0)]
-      response = Api::Response.new([phase0, phase1], 1200)
+      box = partial_refresh(radio, caps, ranges, pages)
+      @inflight[radio] = [image, ranges, !box.nil?, pages]
+      # If we die before this is acknowledged, the radish's screen could be
+      # half written.
+      @sessions.update radio, 'lasttry' => @lasttry[radio],
+        'stale' => PacketPlanner.merge_ranges(@stale[radio] + ranges)
+
+      rle = PacketPlanner.rle_mode(caps)
+      commands = image.packets(ranges, rle)
+      key = [image.digest, rle, ranges]
+      skip = resume_point(radio, key, buttons, last_count, commands.length)
+      phase0 = commands[skip..-1]
+      # Turn on whatever makes the transfer quicker, for this wakeup only.
+      if (options = PacketPlanner.options_packet(caps))
+        phase0 = [Api::Frame.new(options, Ascii::SOH)] + phase0
+      end
+      @transfers[radio] = [key, skip, !options.nil?]
+      phase1 = [box ? PacketPlanner.display_area_packet(0, box) :
+                PacketPlanner.display_fullscreen_packet(0)]
+      bytes = (phase0 + phase1).inject(0) { |sum, p| sum + p.length }
+      sleep_time = sleep_for(radio, floor, EnergyScheduler.send_cost(bytes),
+                             pages)
+      response = Api::Response.new([phase0, phase1], sleep_time)
+      response.clock = @clocks.rate(radio)
+      if caps & PacketPlanner::CAP_PAGES != 0
+        feed = @feedurls[radio].is_a?(Hash) ? @feedurls[radio] : {}
+        response.schedule = PacketPlanner.page_schedule(pages,
+          flip_seconds(radio), feed['rotate'], response.clock)
+      end
+      # It refreshes the screen before it goes to sleep, so this wakeup says
+      # nothing about its clock.
+      @clocks.expect radio, nil
       # This logging is a bit verbose... but I think it'll be OK to leave
       # on. It doesn't get sent to the server.
       response.debug = (@debug_level >= 1)
       response.retries = 3
+      @responses[radio] = response
 
-      log packet, 'send', {'url' => url, 'length' => response.length}
+      dirty = ranges.inject(0) { |sum, range| sum + range[1] }
+      log packet, 'send', {'url' => url, 'length' => response.length,
+        'dirty' => dirty, 'packets' => phase0.length + phase1.length,
+        'sleep' => sleep_time,
+        'refresh' => box ? box.join(',') : 'full',
+        'pages' => pages > 1 ? pages : nil,
+        'resumed' => skip > 0 ? skip : nil}
 
       return response
     end
@@ -310,9 +570,54 @@ module Radish
     def update_state(request, state)
       source = request.address
       # record last success
-      @lastsync[source] = Time.now if state == 'ack'
+      if state == 'ack'
+        @lastsync[source] = Time.now
+        # The radish has everything we sent, so its display RAM now matches
+        # the image we sent it.
+        @transfers.delete source
+        if (inflight = @inflight.delete source)
+          @screens[source] = inflight[0]
+          @stale.delete source
+          @partials[source] = inflight[2] ? @partials[source] + 1 : 0
+          @pages[source] = inflight[3]
+        end
+        screen = @screens[source]
+        @sessions.update source, 'lastsync' => @lastsync[source],
+          'screen' => screen && screen.digest, 'stale' => nil,
+          'partials' => @partials[source], 'pages' => @pages[source]
+      end
       elapsed = Time.now - @lasttry[source]
-      log request, state, {'elapsed' => elapsed}
+      other = {'elapsed' => elapsed}
+      labels = {'mac' => source}
+      @metrics.observe 'radish_transfer_seconds', elapsed,
+        labels.merge('result' => state)
+
+      if state == 'nak'
+        failure, overruns = request.data.unpack('CCCC')[2, 2]
+        other['failure'] = FAILURES[failure] || failure
+        @metrics.count 'radish_naks_total',
+          labels.merge('failure' => other['failure'].to_s)
+        # Firmware with the receive buffer counts the bytes it lost.
+        other['overruns'] = overruns if overruns
+        # The radish couldn't keep up, so back off next time.
+        @api.link(source).overrun if failure == 1 and @api
+      end
+
+      # How the transfer went, so we can see how well the window is doing.
+      if (response = @responses.delete source)
+        other['window'] = '%.1f-%.1f' % [response.min_window,
+                                          response.max_window]
+        other['resent'] = response.resent
+        @metrics.count 'radish_packets_sent_total', labels,
+          response.sent_packets
+        @metrics.count 'radish_packets_resent_total', labels, response.resent
+      end
+      if @api
+        other['link'] = @api.link(source).report
+        @sessions.update source, @api.link(source).state
+      end
+
+      log request, state, other
 
       return nil
     end
@@ -320,6 +625,9 @@ module Radish
     def print_timing(rx)
       cycles = rx.data.unpack('Cn')[1]
       ticks = cycles * 6 + 12
+      @api.link(rx.address).rtt = ticks / 1000000.0 if @api
+      @metrics.observe 'radish_response_cycles', cycles,
+        'mac' => rx.address
       log rx, 'timing', {
         'seconds' => ticks / 1000000.0,
         'cycles' => cycles,
@@ -327,15 +635,86 @@ module Radish
       return nil
     end
 
+    def describe_metrics
+      m = @metrics
+      m.describe 'radish_wakeups_total', :counter, 'Hellos from each radish.'
+      m.describe 'radish_cap_volts', :gauge,
+        'Capacitor voltage in the last hello.'
+      m.describe 'radish_temperature_fahrenheit', :gauge,
+        'Temperature in the last hello, if the radish has a sensor.'
+      m.describe 'radish_rssi_dbm', :gauge,
+        'Signal strength of the last hello.'
+      m.describe 'radish_transfer_seconds', :histogram,
+        'Time from a hello to the ACK, NAK or CAN that ends the transfer.',
+        [0.25, 0.5, 1, 2, 4, 8, 16, 32]
+      m.describe 'radish_naks_total', :counter, 'NAKs, by failure mode.'
+      m.describe 'radish_packets_sent_total', :counter,
+        'Packets sent in finished transfers, including resends.'
+      m.describe 'radish_packets_resent_total', :counter,
+        'Packets that had to be sent again.'
+      m.describe 'radish_response_cycles', :histogram,
+        'Time the radish waited for its first packet, from TIMING_REPORT, ' +
+        'in units of 6us.', [500, 1000, 2000, 5000, 10000, 15000, 22000]
+      m.describe 'radish_link_window', :gauge,
+        'Packets in flight the last transfer finished with.'
+      m.describe 'radish_link_nak_rate', :gauge,
+        'Moving average of the fraction of packets that failed to send.'
+      m.describe 'radish_link_status_seconds', :gauge,
+        'Moving average of the time to hear whether a packet got there.'
+      m.describe 'wongle_writer_queue_depth', :gauge,
+        'Responses waiting to be sent or being sent.'
+      m.describe 'wongle_frame_ids_in_use', :gauge,
+        'XBee frame IDs waiting on a TRANSMIT_STATUS, out of 255.'
+      m.describe 'wongle_framing_errors_total', :counter,
+        'Bad frames from the XBee, by kind.'
+      m.describe 'wongle_log_entries_dropped_total', :counter,
+        'Log entries thrown away before they got to the wangler.'
+
+      m.collect do
+        if @shipper
+          m.set 'wongle_log_entries_dropped_total', @shipper.dropped
+        end
+        if @api
+          m.set 'wongle_writer_queue_depth', @api.queue_depth
+          m.set 'wongle_frame_ids_in_use', @api.frame_ids_in_use
+          for kind, n in @api.framing_errors
+            m.set 'wongle_framing_errors_total', n, 'kind' => kind.to_s
+          end
+          for radio, link in @api.links
+            labels = {'mac' => radio}
+            m.set 'radish_link_window', link.window, labels
+            m.set 'radish_link_nak_rate', link.nak_rate, labels
+            m.set 'radish_link_status_seconds', link.status_latency, labels
+          end
+        end
+      end
+    end
+
     def run
       Thread.abort_on_exception = true
       log nil, 'startup'
+      restore_sessions
 
       for radish, url in @feedurls
         log_radish_change radish, 'startup', url
       end
 
-      api = Api.new(@connection)
+      listen { |message| handle_message message }
+      begin
+        @metrics.serve @metrics_port if @metrics_port
+      rescue SystemCallError => e
+        puts "Couldn't serve metrics on port #{@metrics_port}: #{e.inspect}"
+        STDOUT.flush
+      end
+      dispatch
+    end
+
+    # Answers the radishes until the connection to the XBee closes.
+    def dispatch
+      @api = api = Api.new(@connection, @escaped)
+      for radio, state in @saved_links
+        api.link(radio).restore state
+      end
       api.debug = (@debug_level >= 2)
       api.dispatch_loop do |rx|
         if debug_level >= 2
@@ -384,11 +763,24 @@ if __FILE__ == $0
             "Specify the debugging level (default 0)") { |arg|
       server.debug_level = arg || 0
     }
+    opts.on("--capture FILE",
+            "Record the serial line to FILE, for replay.rb") { |arg|
+      server.capture_file = arg
+    }
     opts.on("--tty DEVICE",
             "Specify a non-default serial device " +
             "[default: #{server.tty}]") { |arg|
       server.tty = arg
     }
+    opts.on("--metrics PORT", Integer,
+            "Serve metrics on localhost:PORT, or 0 for none " +
+            "[default: #{server.metrics_port}]") { |arg|
+      server.metrics_port = arg == 0 ? nil : arg
+    }
+    opts.on("--escaped",
+            "The XBee is in escaped API mode (AP=2)") {
+      server.escaped = true
+    }
   end.parse!
 
   server.connect
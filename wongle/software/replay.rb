@@ -0,0 +1,280 @@
+#!/usr/bin/ruby
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Plays a capture from radio_server.rb --capture back into a RadioServer,
+# and compares what it sends with what the server sent at the time.
+#
+# The server answers from whatever state, feedurls and images it finds,
+# and changes them the way a live server would. So by default it runs on a
+# temporary copy of the wongle's BASEDIR, and --basedir points it at a
+# directory of your own to use as it is. The sleep times in CANs and the last
+# packet of each transfer depend on the time and the radish's charge
+# history and clock, so they aren't compared unless --exact is given.
+#
+# At --speed 1 the XBee's bytes come in with their original timing. Faster
+# replays check that nothing breaks under a burst; --speed 0 goes as fast
+# as the server can take them, for profiling. Either way, nothing from the
+# XBee is played back before the server has sent as many frames as it had
+# at that point, since most of it is about those frames. The server's
+# replies to different radishes may still interleave differently, so
+# they're compared radish by radish.
+#
+#   ./replay.rb [--speed N] [--exact] [--basedir DIR] [-v] capture
+
+$: << File.dirname($0)
+
+require 'benchmark'
+require 'fileutils'
+require 'optparse'
+require 'thread.rb'
+require 'tmpdir'
+require 'capture'
+require 'frame_decoder'
+require 'radio_server'
+
+module Radish
+  class Replay
+    # How long to wait for the server's last replies after the last byte
+    # from the XBee, in seconds.
+    TAIL = 1.0
+
+    # Longest to wait for the server to send what it had sent at this
+    # point in the capture, before carrying on without it.
+    STALL = 2.0
+
+    # Stands in for the Connection to the XBee.
+    class ReplayConnection
+      # [time, data] for each write, since the replay started
+      attr_reader :writes
+
+      # reads are [time, data, writes before it] for each read.
+      def initialize(reads, speed)
+        @reads = reads
+        @speed = speed
+        @writes = []
+        @lock = Mutex.new
+        @written = ConditionVariable.new
+        @start = nil
+      end
+
+      def read_available(length = 4096)
+        @start ||= Capture.now
+        time, data, written = @reads.shift
+        if data.nil?
+          sleep TAIL
+          raise EOFError
+        end
+        if @speed > 0
+          wait = time / @speed - (Capture.now - @start)
+          sleep wait if wait > 0
+        end
+        # Most of what the XBee says is about frames we sent it, so it can't
+        # come before they've gone out, however fast we're going.
+        give_up = Capture.now + STALL
+        @lock.synchronize do
+          while @writes.length < written and Capture.now < give_up
+            @written.wait(@lock, give_up - Capture.now)
+          end
+        end
+        data
+      end
+
+      def write(*args)
+        @lock.synchronize do
+          @writes << [Capture.now - (@start || Capture.now), args.join]
+          @written.signal
+        end
+      end
+    end
+
+    attr_accessor :speed, :exact, :verbose, :escaped
+
+    # The server's state to replay into, used as it is, or nil for a copy of
+    # BASEDIR.
+    attr_accessor :basedir
+
+    def initialize(file)
+      @file = file
+      @speed = 1.0
+      @exact = false
+      @verbose = false
+      @escaped = false
+      @basedir = nil
+    end
+
+    # Returns whether the server sent what it sent at the time.
+    def run
+      return replay(@basedir) if @basedir
+      copy = Dir.mktmpdir('radish-replay')
+      begin
+        copy_state Daemon::BASEDIR, copy
+        replay copy
+      ensure
+        FileUtils.rm_rf copy
+      end
+    end
+
+    private
+
+    def replay(basedir)
+      Daemon.basedir = basedir
+      reads = []
+      recorded = []
+      Capture.each(@file) do |time, direction, data|
+        if direction == 'r'
+          reads << [time, data, recorded.length]
+        else
+          recorded << data
+        end
+      end
+      frames_in = count_frames(reads.map { |read| read[1] })
+
+      connection = ReplayConnection.new(reads, @speed)
+      server = RadioServer.new
+      server.connection = connection
+      server.escaped = @escaped
+      Thread.abort_on_exception = true
+      out = STDOUT.dup
+      STDOUT.reopen('/dev/null', 'w') if !@verbose
+      elapsed = Benchmark.realtime do
+        server.restore_sessions
+        begin
+          server.dispatch
+        rescue EOFError
+        end
+      end
+      STDOUT.reopen out
+
+      replayed = connection.writes.map { |time, data| data }
+      puts "%d frames in, %d out (%d at the time) in %.2f s: %.0f frames/s" %
+        [frames_in, replayed.length, recorded.length, elapsed - TAIL,
+         (frames_in + replayed.length) / (elapsed - TAIL)]
+      compare(by_radish(recorded), by_radish(replayed))
+    end
+
+    # Copies what the radio server reads, leaving out logs, pid files and
+    # sockets.
+    def copy_state(from, to)
+      for path in Dir[File.join(from, '*')]
+        name = File.basename(path)
+        if name == 'packets'
+          FileUtils.cp_r path, to
+        elsif File.file?(path) and name !~ /\.(log|pid)$/
+          FileUtils.cp path, to
+        end
+      end
+    end
+
+    def count_frames(chunks)
+      decoder = FrameDecoder.new(@escaped)
+      n = 0
+      for chunk in chunks
+        decoder << chunk
+        n += 1 while decoder.next_frame
+      end
+      n
+    end
+
+    # The RF data sent to each radish, in order, keyed by address.
+    def by_radish(writes)
+      decoder = FrameDecoder.new(@escaped)
+      radishes = Hash.new { |h, k| h[k] = [] }
+      for write in writes
+        decoder << write
+        while (frame = decoder.next_frame)
+          id, address, data = frame.unpack('CxH16xa*')
+          next if id != Api::TRANSMIT_REQUEST
+          # The sleep time rides in a CAN, and after the commands in an ETX,
+          # along with the page schedule, which goes by the radish's clock.
+          if !@exact and data[0, 1] == Ascii::CAN
+            data = data[0, 1]
+          elsif !@exact and data[0, 1] == Ascii::ETX
+            data = data[0, 3 + (data[2, 1].unpack('C')[0] & 0x7F)]
+          end
+          radishes[address] << data
+        end
+      end
+      radishes
+    end
+
+    def compare(recorded, replayed)
+      same = true
+      for address in (recorded.keys + replayed.keys).uniq.sort
+        old = recorded[address]
+        new = replayed[address]
+        matching = 0
+        matching += 1 while matching < old.length and
+          matching < new.length and old[matching] == new[matching]
+        if matching == old.length and matching == new.length
+          puts "#{address}: #{old.length} packets, all the same"
+          next
+        end
+        same = false
+        puts "#{address}: #{old.length} packets then, #{new.length} now, " +
+          "first #{matching} the same"
+        puts "  then: #{hex old[matching]}"
+        puts "  now:  #{hex new[matching]}"
+      end
+      same
+    end
+
+    def hex(data)
+      return '(nothing)' if data.nil?
+      s = data[0, 16].unpack('C*').map { |c| '%02x' % c }.join(' ')
+      data.length > 16 ? s + " ... (#{data.length} bytes)" : s
+    end
+  end
+end
+
+if __FILE__ == $0
+  options = {}
+  OptionParser.new do |opts|
+    opts.banner = "Usage: #{$0} [options] capture"
+
+    opts.on("--speed N", Float,
+            "Times the original speed, or 0 for as fast as possible " +
+            "[default: 1]") { |arg|
+      options[:speed] = arg
+    }
+    opts.on("--exact", "Compare sleep times too") {
+      options[:exact] = true
+    }
+    opts.on("--escaped",
+            "The XBee was in escaped API mode (AP=2)") {
+      options[:escaped] = true
+    }
+    opts.on("--basedir DIR",
+            "Replay into the state in DIR, rather than a copy of " +
+            "#{Radish::Daemon::BASEDIR}") { |arg|
+      options[:basedir] = arg
+    }
+    opts.on("-v", "--verbose", "Show the server's log") {
+      options[:verbose] = true
+    }
+  end.parse!
+  if ARGV.length != 1
+    puts "Usage: #{$0} [options] capture"
+    exit 2
+  end
+
+  replay = Radish::Replay.new(ARGV[0])
+  replay.speed = options[:speed] if options[:speed]
+  replay.exact = options[:exact]
+  replay.verbose = options[:verbose]
+  replay.escaped = options[:escaped]
+  replay.basedir = options[:basedir]
+  exit(replay.run ? 0 : 1)
+end
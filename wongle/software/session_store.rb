@@ -0,0 +1,187 @@
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require 'daemon'
+require 'threaded_queue'
+
+module Radish
+  # What the radio server knows about each radish, kept on disk so that a
+  # restart doesn't mean sending every radish a whole screen.
+  #
+  # The file is a log of updates, one line each:
+  #
+  #   0013a200406157c3 lastsync=1243456789.123 screen=9f3c... stale=0:9600
+  #
+  # Later lines override earlier ones field by field. Lines are only ever
+  # appended, and a line cut short by a crash is ignored, so the worst a
+  # crash can do is lose the last few updates. The log is rewritten with
+  # one line per radish at startup and whenever it gets long.
+  class SessionStore
+    def self.file
+      Daemon.basedir + 'sessions'
+    end
+
+    # How to read each field back. Anything else is ignored.
+    FIELDS = {
+      'screen' => :string,        # digest of the image last acknowledged
+      'stale' => :ranges,         # what an unacknowledged transfer touched
+      'lasttry' => :time,
+      'lastsync' => :time,
+      'window' => :float,         # Api::Link state
+      'rtt' => :float,
+      'status_latency' => :float,
+      'nak_rate' => :float,
+      'partials' => :integer,     # partial refreshes since the last full one
+      'pages' => :integer,        # pages the radish flips between
+      'charge' => :floats,        # EnergyScheduler state
+      'volts' => :float,
+      'sampled' => :time,
+      'spent' => :float,
+      'predicted' => :float,
+      'next_change' => :time,     # when SignFetcher says the image changes
+      'clock' => :float,          # ClockCalibration rate
+    }
+
+    # The log is compacted when it has this many lines per radish.
+    COMPACT_RATIO = 20
+
+    def initialize(file = SessionStore.file)
+      @file = file
+      # keyed by mac, value is a hash of fields
+      @sessions = {}
+      @lines = 0
+      @log = nil
+      @updates = ThreadedQueue.new(&method(:write_updates))
+    end
+
+    # Reads the log and returns the sessions, keyed by mac.
+    def load
+      begin
+        File.open(@file, 'rb') do |f|
+          f.each_line do |line|
+            # cut short by a crash
+            next if line[-1, 1] != "\n"
+            mac, *fields = line.split
+            merge mac, parse(fields) if mac
+          end
+        end
+      rescue Errno::ENOENT
+      end
+      compact
+      @sessions
+    end
+
+    # Records new values for some of a radish's fields. Nil clears a field.
+    # The write happens in the background.
+    def update(mac, fields)
+      @updates << [mac, fields]
+    end
+
+    private
+
+    def merge(mac, fields)
+      session = (@sessions[mac] ||= {})
+      for key, value in fields
+        if value.nil?
+          session.delete key
+        else
+          session[key] = value
+        end
+      end
+    end
+
+    def parse(fields)
+      parsed = {}
+      for field in fields
+        key, value = field.split('=', 2)
+        next if value.nil? or !FIELDS[key]
+        parsed[key] =
+          if value == '-'
+            nil
+          else
+            case FIELDS[key]
+            when :string then value
+            when :time then Time.at(value.to_f)
+            when :float then value.to_f
+            when :integer then value.to_i
+            when :floats
+              value.split(',', -1).map { |x| x.empty? ? nil : x.to_f }
+            when :ranges
+              value.split(',').map { |range| range.split(':').map { |x|
+                x.to_i } }
+            end
+          end
+      end
+      parsed
+    end
+
+    def encode(mac, fields)
+      line = mac.dup
+      for key, value in fields
+        line << ' ' << key << '=' <<
+          case value
+          when nil then '-'
+          when Time then '%.3f' % value.to_f
+          when Array
+            # ranges, or floats that may be missing
+            value.empty? ? '-' : value.map { |r|
+              r.is_a?(Array) ? r.join(':') : r.to_s }.join(',')
+          else value.to_s
+          end
+      end
+      line << "\n"
+    end
+
+    # Rewrites the log with one line per radish.
+    def compact
+      tmp = @file + ".tmp#{$$}"
+      File.open(tmp, 'wb') do |f|
+        for mac, fields in @sessions
+          f.write encode(mac, fields)
+        end
+        f.fsync
+      end
+      File.rename tmp, @file
+      @log.close if @log
+      @log = nil
+      open_log
+      @lines = @sessions.length
+    end
+
+    def open_log
+      @log ||= File.open(@file, 'ab')
+      # unbuffered, so every line goes out in one write
+      @log.sync = true
+      @log
+    end
+
+    # Run by the update queue's worker.
+    def write_updates
+      open_log
+      while (update = @updates.shift)
+        mac, fields = update
+        merge mac, fields
+        # A crash can only cut off the end of the line.
+        @log.write encode(mac, fields)
+        @lines += 1
+      end
+      @log.fsync
+      compact if @lines > COMPACT_RATIO * [@sessions.length, 10].max
+    rescue StandardError => e
+      puts "Couldn't save sessions: #{e.inspect}"
+      STDOUT.flush
+    end
+  end
+end
@@ -17,8 +17,9 @@
 $: << File.dirname($0)
 
 require 'daemon'
-require 'net/https'
-require 'uri'
+require 'http_pool'
+require 'packet_cache'
+require 'thread.rb'
 require 'yaml'
 require 'time'
 
@@ -27,44 +28,135 @@ module Radish
   class MissingImage < RuntimeError; end
   class WrongImageSize < RuntimeError; end
   class NotModified < RuntimeError; end
-  class SleepInterrupted < RuntimeError; end
   class SignFetcher < Daemon
 
-    MAX_AGE = 300 # how often to build new signs
+    MAX_AGE = 300 # how often to build new signs, unless the feed says
+    # A feed can send up to PacketPlanner::MAX_PAGES of these one after
+    # another, for radishes that flip between pages.
     IMAGE_SIZE_BYTES = 9611
+    # feeds fetched at once
+    WORKERS = 8
+    # longest we'll go without checking a feed, whatever its Cache-Control
+    # header says
+    MAX_CACHE_AGE = 24 * 3600
+    # A render server can say when its content changes next with this
+    # header, as an HTTP date or seconds since the epoch. The feed gets
+    # fetched again then, and the signs are woken up just after.
+    NEXT_CHANGE_HEADER = 'X-Radish-Next-Change'
+    # Even if the render server says the content changes sooner, we don't
+    # fetch it more often than this.
+    MIN_INTERVAL = 10
+
+    # One URL, and all the signs showing it.
+    class Feed
+      attr_reader :url
+      attr_accessor :macs
+      # seconds between fetches
+      attr_accessor :interval
+      attr_accessor :next_fetch
+      # validators from the last good response, for a conditional GET
+      attr_accessor :etag, :last_modified
+      # when the last response said the content would change, or nil
+      attr_accessor :next_change
+      # whether it's waiting for or being fetched by a worker
+      attr_accessor :busy
+
+      def initialize(url)
+        @url = url
+        @macs = []
+        @interval = MAX_AGE
+        @next_fetch = Time.now
+        @etag = nil
+        @last_modified = nil
+        @next_change = nil
+        @busy = false
+      end
+    end
+
+    def initialize
+      super
+      # keyed by url
+      @feeds = {}
+      @lock = Mutex.new
+      # signalled when a worker finishes a feed
+      @done = ConditionVariable.new
+      @jobs = Queue.new
+      @http = HttpPool.new
+      @reload = true
+    end
 
     def log(string)
       puts "#{Time.now.xmlschema} #{string}"
     end
 
-    def download_image(url, lastmod)
-      uri = URI.parse url
-      http = Net::HTTP.new uri.host, uri.port
-      if uri.scheme == 'https'
-        http.use_ssl = true # enable SSL/TLS
-        if File.directory? '/etc/ssl/certs'
-          http.ca_path = '/etc/ssl/certs'
-          http.verify_mode = OpenSSL::SSL::VERIFY_PEER
-        end
+    # Seconds a response may be used for, from its Cache-Control header.
+    def max_age(res)
+      cache_control = res['Cache-Control'] or return nil
+      return 0 if cache_control =~ /no-cache|no-store/
+      return nil if cache_control !~ /max-age\s*=\s*"?(\d+)/
+      [$1.to_i, MAX_CACHE_AGE].min
+    end
+
+    # Parses an HTTP date or a number of seconds since the epoch.
+    def parse_time(value)
+      return nil if value.nil?
+      return Time.at(value.to_i) if value =~ /\A\s*\d+\s*\z/
+      Time.httpdate(value) rescue nil
+    end
+
+    # When the content is due to change, going by the response: the render
+    # server's NEXT_CHANGE_HEADER if it sent one, or failing that when the
+    # response expires. nil if it doesn't say, or that's already passed.
+    def next_change(res, now = Time.now)
+      change = parse_time(res[NEXT_CHANGE_HEADER])
+      if !change
+        # Cache-Control wins over Expires, like it does for caches.
+        age = max_age(res)
+        change = age ? now + age : parse_time(res['Expires'])
       end
-      http.read_timeout = 120
+      change && change > now ? change : nil
+    end
+
+    # Returns the body, or raises NotModified. Unless fresh is set, this is
+    # a conditional GET based on what the last response said about itself.
+    def download_image(feed, fresh)
+      uri = URI.parse feed.url
       header = {}
-      header['If-Modified-Since'] = lastmod.httpdate if lastmod
-      res = nil
-      http.start do
-        res = http.request_get uri.request_uri, header
+      if !fresh
+        header['If-None-Match'] = feed.etag if feed.etag
+        header['If-Modified-Since'] = feed.last_modified if feed.last_modified
       end
+      res = @http.get uri, header
       raise NoResponse if res.nil?
+
+      # The feed can ask us to leave it alone for longer, but whenever it
+      # says when the content changes, we come back then. RadioServer is
+      # told to wake the radish for it, so the new image had better be here.
+      now = Time.now
+      age = max_age(res)
+      feed.next_fetch = now + [feed.interval, age || 0].max
+      feed.next_change = next_change(res, now)
+      if feed.next_change
+        feed.next_fetch = [[feed.next_fetch, feed.next_change].min,
+                           now + MIN_INTERVAL].max
+      end
+
       raise NotModified if res.is_a? Net::HTTPNotModified
+      if res.is_a? Net::HTTPSuccess
+        feed.etag = res['ETag']
+        feed.last_modified = res['Last-Modified']
+      end
       return res.body
     end
 
-    def write_image(new_data, filename)
-      filename_tmp = BASEDIR + "tmp#{$$}"
-
+    def write_image(new_data, mac)
+      filename = basedir + mac + '.pbm'
+      # every worker needs its own temp file
+      filename_tmp = basedir + "tmp#{$$}-#{Thread.current.object_id}"
       # build the new image and grab the old one off of the disk
       # Providing number of bytes forces it to binary mode read.
-      old_data = File.read(filename, IMAGE_SIZE_BYTES) rescue nil
+      most = IMAGE_SIZE_BYTES * PacketPlanner::MAX_PAGES
+      old_data = File.read(filename, most) rescue nil
 
       # don't touch the files if nothings changed
       if new_data == old_data
@@ -82,50 +174,157 @@ module Radish
 
       log "updated" if verbose
 
+      # get the packets ready now, so the radio server doesn't have to
+      # when the radish checks in
+      begin
+        PacketCache.precompute new_data, old_data
+        log "precomputed packets" if verbose
+      rescue => e
+        log "couldn't precompute packets: #{e.inspect}"
+      end
+
+      # let the radio server know, so it doesn't have to check the file
+      send_message 'RadioServer',
+                   "image #{mac} #{Digest::SHA1.hexdigest new_data}"
+
     end
 
-    def do_one_sign(mac, url)
-      begin
+    # Tells the radio server when the feed's signs should next wake up.
+    def announce_next_change(feed)
+      return if feed.next_change.nil?
+      for mac in feed.macs
+        send_message 'RadioServer', "next #{mac} #{feed.next_change.to_i}"
+      end
+    end
 
-        filename = BASEDIR + mac + '.pbm'
+    def do_one_feed(feed)
+      begin
+        filenames = feed.macs.map { |mac| basedir + mac + '.pbm' }
 
-        # last modified time on the file
-        lastmod = File.exists?(filename) ?
-            File.mtime(filename) : nil
+        # A sign that's just been pointed at this feed needs the image
+        # whether or not it's changed.
+        fresh = filenames.any? { |filename| !File.exist? filename }
+        if !fresh and !feed.etag and !feed.last_modified
+          # Nothing to go on since we started up, so use the files.
+          feed.last_modified = filenames.map { |filename|
+            File.mtime filename
+          }.min.httpdate
+        end
 
         pbm = begin
-          download_image url, lastmod 
+          download_image feed, fresh
         rescue NotModified
-          log "not modified" if verbose
+          log "#{feed.url}: not modified" if verbose
+          announce_next_change feed
           return
         end
         raise MissingImage if pbm.nil? or pbm == ""
-        raise WrongImageSize if pbm.to_s.length != IMAGE_SIZE_BYTES
-        write_image pbm, filename
+        pages = pbm.to_s.length / IMAGE_SIZE_BYTES
+        raise WrongImageSize if pbm.to_s.length % IMAGE_SIZE_BYTES != 0 or
+          pages > PacketPlanner::MAX_PAGES
+        for mac in feed.macs
+          log "#{mac}: writing #{feed.url}" if verbose
+          write_image pbm, mac
+        end
+        announce_next_change feed
 
       rescue => e
-        STDERR.printf "%s failed: %s\n", mac, e.inspect
+        STDERR.printf "%s failed: %s\n", feed.url, e.inspect
+        # Try again after the usual interval.
+        feed.next_fetch = Time.now + feed.interval
+        feed.etag = feed.last_modified = feed.next_change = nil
       end
     end
 
     def feedurls
       # if file is corrupted or missing,
       # skip this pass for now
-      YAML.load(File.read(BASEDIR + 'feedurls')) rescue {}
+      YAML.load(File.read(basedir + 'feedurls')) rescue {}
+    end
+
+    # Rebuilds the feed list from the feedurls file. Signs that share a URL
+    # share a Feed, which is fetched as often as the most impatient of them
+    # asks. Feeds that gained a sign get fetched right away.
+    def reload_feeds
+      signs = {}
+      for mac, entry in feedurls
+        url, interval = entry, nil
+        url, interval = entry['url'], entry['interval'] if entry.is_a? Hash
+        next if url.nil?
+        interval = (interval || MAX_AGE).to_i
+        macs, shortest = signs[url] || [[], interval]
+        signs[url] = [macs << mac, [shortest, interval].min]
+      end
+
+      @lock.synchronize do
+        old = @feeds
+        @feeds = {}
+        for url, (macs, interval) in signs
+          feed = @feeds[url] = old[url] || Feed.new(url)
+          feed.next_fetch = Time.now if (macs - feed.macs).any?
+          feed.macs = macs
+          feed.interval = interval
+        end
+      end
+    end
+
+    def worker
+      loop do
+        feed = @jobs.pop
+        log "#{feed.url}: fetch for #{feed.macs.join ', '}" if verbose
+        do_one_feed feed
+        @lock.synchronize do
+          feed.busy = false
+          # There may be a new time to wake up for.
+          @done.signal
+        end
+      end
+    end
+
+    # RadioServer sends "reload" when feedurls changes.
+    def handle_message(message)
+      if message == 'reload'
+        @lock.synchronize do
+          @reload = true
+          @done.signal
+        end
+      else
+        log "unknown message #{message.inspect}"
+      end
     end
 
     def run
-      Signal.trap('HUP') { raise SleepInterrupted }
+      Thread.abort_on_exception = true
+      Signal.trap('HUP') do
+        @reload = true
+        Thread.main.wakeup
+      end
+      listen { |message| handle_message message }
+      WORKERS.times { Thread.new { worker } }
+
       while true
-        feedurls.each do |mac, url|
-          log "#{mac}: fetch #{url}" if verbose
-          do_one_sign mac, url
+        if @reload
+          @reload = false
+          log "reloading feedurls" if verbose
+          reload_feeds
         end
-        log "sleeping" if verbose
-        begin
-          sleep MAX_AGE
-        rescue SleepInterrupted
-          log "Early Wakeup" if verbose
+
+        @lock.synchronize do
+          now = Time.now
+          wait = MAX_AGE
+          for feed in @feeds.values
+            next if feed.busy
+            if feed.next_fetch <= now
+              feed.busy = true
+              @jobs << feed
+            else
+              wait = [wait, feed.next_fetch - now].min
+            end
+          end
+
+          log "sleeping" if verbose
+          # Workers wake us when they finish a feed, and so does a reload.
+          @done.wait @lock, wait if !@reload
         end
       end
     end
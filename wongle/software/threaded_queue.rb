@@ -1,12 +1,12 @@
 #
 # Copyright 2009 Google Inc.
-# 
+#
 # Licensed under the Apache License, Version 2.0 (the "License");
 # you may not use this file except in compliance with the License.
 # You may obtain a copy of the License at
-# 
+#
 #      http://www.apache.org/licenses/LICENSE-2.0
-# 
+#
 # Unless required by applicable law or agreed to in writing, software
 # distributed under the License is distributed on an "AS IS" BASIS,
 # WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
@@ -15,43 +15,72 @@
 require 'thread.rb'
 
 module Radish
-  class ThreadedQueue < Array
-    def initialize(*args, &block)
-      @thread_running = false
+  # A bounded queue with a worker thread of its own. Whenever there's
+  # something in the queue, the worker calls the handler block, which is
+  # expected to take items off with shift until it's done.
+  #
+  # The worker lives as long as the queue does and sleeps on a condition
+  # variable when there's nothing to do, so handing it an item doesn't cost
+  # a thread creation.
+  class ThreadedQueue
+    DEFAULT_CAPACITY = 1024
+
+    attr_reader :capacity
+
+    # When the queue is full, producers block in << until there's room.
+    def initialize(capacity = DEFAULT_CAPACITY, &block)
+      @capacity = capacity
       @handler_proc = block
+      @ring = Array.new(capacity)
+      @head = 0  # index of the oldest item
+      @count = 0
       @mutex = Mutex.new
-      super(*args)
+      @items_ready = ConditionVariable.new
+      @space_ready = ConditionVariable.new
+      @worker = nil
+    end
+
+    def <<(item)
+      @mutex.synchronize do
+        @space_ready.wait(@mutex) while @count >= @capacity
+        @ring[(@head + @count) % @capacity] = item
+        @count += 1
+        @worker ||= Thread.new { work }
+        @items_ready.signal
+      end
+      self
     end
 
-    def <<(*args)
-      rv = super(*args)
-
-      @mutex.lock
-      if !@thread_running
-        @thread_running = true
-        @mutex.unlock
-
-        Thread.new do
-          begin
-            @mutex.lock
-            while !empty?
-              @mutex.unlock
-              begin
-                @handler_proc.call
-              ensure
-                @mutex.lock
-              end
-            end
-          ensure
-            @thread_running = false
-            @mutex.unlock
-          end
-        end  # Thread.new
-      else
-        @mutex.unlock
-      end  # if
-
-      return rv
+    # Removes and returns the oldest item, or nil if there isn't one.
+    def shift
+      @mutex.synchronize do
+        return nil if @count == 0
+        item = @ring[@head]
+        @ring[@head] = nil
+        @head = (@head + 1) % @capacity
+        @count -= 1
+        @space_ready.signal
+        item
+      end
+    end
+
+    def length
+      @mutex.synchronize { @count }
+    end
+
+    def empty?
+      length == 0
+    end
+
+    private
+
+    def work
+      loop do
+        @mutex.synchronize do
+          @items_ready.wait(@mutex) while @count == 0
+        end
+        @handler_proc.call
+      end
     end
   end
 end
@@ -0,0 +1,293 @@
+#!/usr/bin/ruby
+#
+# Copyright 2009 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Measures what screen updates cost to send, for a corpus of updates and
+# every kind of firmware the server knows how to talk to. For each one it
+# reports the packets, the bytes on air, how long the radish's radio has
+# to stay on to take them at 57600 baud, the capacitor voltage that's
+# expected to cost, and how long the server takes to plan and send them.
+#
+# The corpus is made up here, so runs are repeatable and need nothing but
+# this directory: the sample image, a meeting room schedule with the kinds
+# of changes schedules get, and some worst cases. --corpus adds the PBMs
+# in a directory, in name order, each one an update to the one before.
+#
+#   ./transport_benchmark.rb [-n iterations] [--corpus DIR]
+
+$: << File.dirname($0)
+
+require 'benchmark'
+require 'optparse'
+require 'api'
+require 'energy_scheduler'
+require 'packet_cache'
+require 'packet_planner'
+
+module Radish
+  class TransportBenchmark
+    # Every kind of radish the server plans differently for: [name,
+    # revision, capabilities from the hello].
+    FIRMWARE = [
+      ['plain', 24, nil],
+      ['rle', 25, nil],
+      ['current', 29, 0x1F],
+    ]
+
+    # Bits per byte on the radish's UART, start and stop bits included.
+    BAUD = 57600
+    BITS_PER_BYTE = 10
+
+    SLEEP_TIME = 1200
+    DESTINATION = '0013a20040000001'
+
+    attr_accessor :iterations, :corpus
+
+    def initialize
+      @iterations = 5
+      @corpus = nil
+    end
+
+    # The updates to measure, as [name, old pbm or nil, new pbm].
+    def updates
+      admiral = File.open(File.dirname(__FILE__) + '/config/the_admiral.pbm',
+                          'rb') { |f| f.read }
+      srand 1
+      schedule = Schedule.new
+      before = schedule.pbm
+      schedule.rows[2] = 'Design review - Ada, Grace'
+      one_row = schedule.pbm
+      schedule.clock = '10:31'
+      clock = schedule.pbm
+      schedule.rows.shift
+      shifted = schedule.pbm
+
+      updates = [
+        ['admiral', nil, admiral],
+        ['admiral-inverted', admiral, invert(admiral)],
+        ['blank', nil, Schedule.new([]).blank],
+        ['schedule', nil, before],
+        ['schedule-row', before, one_row],
+        ['schedule-clock', one_row, clock],
+        ['schedule-shift', clock, shifted],
+        ['noise', nil, "P4\n320 240\n" +
+         (0...9600).map { rand(256) }.pack('C*')],
+      ]
+      if @corpus
+        old = nil
+        for file in Dir[File.join(@corpus, '*.pbm')].sort
+          pbm = File.open(file, 'rb') { |f| f.read }
+          updates << [File.basename(file, '.pbm'), old, pbm]
+          old = pbm
+        end
+      end
+      updates
+    end
+
+    # Measures one update for one kind of firmware.
+    def measure(old, new, revision, caps)
+      caps = PacketPlanner.capabilities(revision, caps)
+      rle = PacketPlanner.rle_mode(caps)
+      raw = PacketCache.pbm2raw(new)
+      old_raw = old && PacketCache.pbm2raw(old)
+
+      response = nil
+      plan = Benchmark.realtime do
+        ranges = old_raw ? PacketPlanner.dirty_ranges(old_raw, raw) :
+          [[0, raw.length]]
+        phase0 = PacketPlanner.new(raw, :rle => rle).plan(ranges).map do |c|
+          Api::Frame.new(c, Ascii::STX)
+        end
+        if (options = PacketPlanner.options_packet(caps))
+          phase0 = [Api::Frame.new(options, Ascii::SOH)] + phase0
+        end
+        box = caps & PacketPlanner::CAP_PARTIAL_REFRESH != 0 &&
+          PacketPlanner.bounding_box(ranges)
+        phase1 = [box ? PacketPlanner.display_area_packet(0, box) :
+                  PacketPlanner.display_fullscreen_packet(0)]
+        response = Api::Response.new([phase0, phase1], SLEEP_TIME)
+      end
+
+      result = {'plan' => plan, 'packets' => 0, 'air' => 0, 'uart' => 0,
+                'cost' => EnergyScheduler.send_cost(response.length)}
+      response.address = DESTINATION
+      # Everything at once: we're counting bytes, not simulating the link.
+      response.window = 1 << 16
+      result['send'] = Benchmark.realtime do
+        frame_id = 0
+        while (sent = response.next(frame_id % 255 + 1))
+          frame, ack = sent
+          frame_id += 1
+          # What reaches the radish's UART: the frame's RF data, after the
+          # API header, frame ID, address and options, less the checksum.
+          data = frame.length - 15
+          result['packets'] += 1
+          result['uart'] += data
+          result['air'] += data + PacketPlanner::PACKET_OVERHEAD
+          ack.call 0
+        end
+      end
+      result
+    end
+
+    def run
+      printf("%-18s %-8s %7s %7s %7s %8s %7s %8s %8s\n", 'update', 'firmware',
+             'packets', 'air B', 'uart B', 'radio ms', 'volts', 'plan ms',
+             'send ms')
+      totals = Hash.new { |h, k| h[k] = Hash.new(0) }
+      for name, old, new in updates
+        for firmware, revision, caps in FIRMWARE
+          # The fastest of a few runs, for the times; the rest doesn't
+          # change.
+          runs = (0...@iterations).map { measure(old, new, revision, caps) }
+          result = runs[0]
+          plan = runs.map { |r| r['plan'] }.min
+          send = runs.map { |r| r['send'] }.min
+          radio = result['uart'] * BITS_PER_BYTE / BAUD.to_f
+          printf("%-18s %-8s %7d %7d %7d %8.1f %7.3f %8.2f %8.2f\n", name,
+                 firmware, result['packets'], result['air'], result['uart'],
+                 radio * 1000, result['cost'], plan * 1000, send * 1000)
+          total = totals[firmware]
+          total['packets'] += result['packets']
+          total['air'] += result['air']
+          total['radio'] += radio
+          total['cost'] += result['cost']
+          total['plan'] += plan
+          total['send'] += send
+        end
+      end
+      puts
+      for firmware, revision, caps in FIRMWARE
+        total = totals[firmware]
+        printf("%-18s %-8s %7d %7d %7s %8.1f %7.3f %8.2f %8.2f\n", 'total',
+               firmware, total['packets'], total['air'], '', total['radio'] *
+               1000, total['cost'], total['plan'] * 1000, total['send'] * 1000)
+      end
+      STDOUT.flush
+    end
+
+    private
+
+    def invert(pbm)
+      pbm[0, 11] + pbm[11..-1].unpack('C*').map { |v| 255 - v }.pack('C*')
+    end
+
+    # A meeting room sign: a black title bar with the room and the time,
+    # then a row of text for each meeting, with rules in between. The text
+    # is made-up glyphs, but they're the size and density of real ones, so
+    # the image compresses like a real sign does.
+    class Schedule
+      ROW_HEIGHT = 24
+      TITLE_HEIGHT = 32
+      GLYPH_WIDTH = 8
+      GLYPH_HEIGHT = 12
+
+      attr_accessor :rows, :clock
+
+      def initialize(rows = nil)
+        @rows = rows || ['Standup', 'Planning - Team Radish',
+                         'Lunch and learn', '1:1 - Sam / Alex',
+                         'Interview loop', 'Board bring-up', 'Retro']
+        @clock = '10:30'
+        # keyed by character, value is rows of glyph bits
+        @glyphs = {}
+      end
+
+      # An all-white screen.
+      def blank
+        "P4\n320 240\n" + "\0" * 9600
+      end
+
+      def pbm
+        pixels = Array.new(240) { Array.new(320, 0) }
+        fill pixels, 0, 0, 320, TITLE_HEIGHT, 1
+        text pixels, 8, 10, 'Room 42', 0
+        text pixels, 320 - 8 - @clock.length * GLYPH_WIDTH, 10, @clock, 0
+        @rows.each_with_index do |row, i|
+          top = TITLE_HEIGHT + i * ROW_HEIGHT
+          break if top + ROW_HEIGHT > 240
+          text pixels, 8, top + 6, row, 1
+          fill pixels, 0, top + ROW_HEIGHT - 1, 320, 1, 1
+        end
+        "P4\n320 240\n" + pixels.map { |line|
+          line.each_slice(8).map { |bits|
+            bits.inject(0) { |byte, bit| byte << 1 | bit }
+          }.pack('C*')
+        }.join
+      end
+
+      private
+
+      def fill(pixels, x, y, width, height, value)
+        for row in y...y + height
+          for column in x...x + width
+            pixels[row][column] = value
+          end
+        end
+      end
+
+      def text(pixels, x, y, string, value)
+        string.each_byte do |c|
+          glyph(c).each_with_index do |bits, row|
+            bits.each_with_index do |bit, column|
+              pixels[y + row][x + column] = value if bit == 1
+            end
+          end
+          x += GLYPH_WIDTH
+        end
+      end
+
+      # A glyph about as dense as a letter: a few strokes in a 6x9 box.
+      def glyph(c)
+        @glyphs[c] ||= begin
+          rows = Array.new(GLYPH_HEIGHT) { Array.new(GLYPH_WIDTH, 0) }
+          if c != 32
+            random = c * 7919
+            4.times do
+              random = (random * 1103515245 + 12345) & 0x7FFFFFFF
+              column = 1 + random % 6
+              row = 1 + (random >> 8) % 9
+              if random & 0x10000 == 0
+                (row...[row + 5, 10].min).each { |r| rows[r][column] = 1 }
+              else
+                (column...[column + 4, 7].min).each { |k| rows[row][k] = 1 }
+              end
+            end
+          end
+          rows
+        end
+      end
+    end
+  end
+end
+
+if __FILE__ == $0
+  benchmark = Radish::TransportBenchmark.new
+  OptionParser.new do |opts|
+    opts.banner = "Usage: #{$0} [options]"
+
+    opts.on("-n", "--iterations N", Integer,
+            "Runs of each update, for timing " +
+            "[default: #{benchmark.iterations}]") { |arg|
+      benchmark.iterations = arg
+    }
+    opts.on("--corpus DIR",
+            "Also send the PBMs in DIR, each an update to the one " +
+            "before") { |arg|
+      benchmark.corpus = arg
+    }
+  end.parse!
+  benchmark.run
+end